@@ -0,0 +1,426 @@
+// Frame encoder microbenchmark.
+// Compares the original buildFrame + byteStuffing path (malloc per frame, two passes)
+// with the single-pass encodeFrame writing into a preallocated buffer, byte stuffing
+// with COBS (speed both ways and size overhead), and measures the Reed-Solomon FEC codec.
+// Every framing, FCS and FEC combination is first checked to decode back to its payload,
+// and to refuse a frame longer than the negotiated payload, and both LZ codecs to
+// decompress back to the payload.
+//
+// Build and run from the project root:
+//   gcc -O2 -Wall -o bin/frame_bench bench/frame_bench.c src/framing.c src/crc.c src/rs.c src/lz.c -Iinclude
+//   ./bin/frame_bench [penguin.gif]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "framing.h"
+#include "lz.h"
+
+#define MIN_BENCH_TIME 0.5 // Seconds per measurement
+
+// Original implementation, kept here as the baseline
+static unsigned char *legacyBuildFrame(const unsigned char *buf, int bufSize, int *frameSize) {
+    int oldFrameSize = bufSize + 6;
+    unsigned char *oldFrame = (unsigned char *) malloc(oldFrameSize);
+
+    oldFrame[0] = FLAG;
+    oldFrame[1] = 0x03;
+    oldFrame[2] = 0x00;
+    oldFrame[3] = 0x03;
+
+    unsigned char BCC2 = 0;
+    for (int i = 0; i < bufSize; i++) {
+        oldFrame[i + 4] = buf[i];
+        BCC2 ^= buf[i];
+    }
+
+    oldFrame[bufSize + 4] = BCC2;
+    oldFrame[bufSize + 5] = FLAG;
+
+    *frameSize = oldFrameSize;
+    return oldFrame;
+}
+
+static unsigned char *legacyByteStuffing(const unsigned char *oldFrame, int oldFrameSize, int *newFrameSize) {
+    unsigned char *newFrame = (unsigned char *) malloc(oldFrameSize * 2);
+
+    int newSize = 0;
+    for (int j = 0; j < 4; j++) {
+        newFrame[newSize++] = oldFrame[j];
+    }
+
+    for (int j = 4; j < oldFrameSize - 1; j++) {
+        if (oldFrame[j] == FLAG) {
+            newFrame[newSize++] = ESC;
+            newFrame[newSize++] = 0x5e;
+        } else if (oldFrame[j] == ESC) {
+            newFrame[newSize++] = ESC;
+            newFrame[newSize++] = 0x5d;
+        } else {
+            newFrame[newSize++] = oldFrame[j];
+        }
+    }
+
+    newFrame[newSize++] = FLAG;
+
+    newFrame = realloc(newFrame, newSize);
+    *newFrameSize = newSize;
+
+    return newFrame;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile int sink;
+
+// Encodes the whole payload as consecutive MAX_PAYLOAD_SIZE frames, returns ns per payload byte
+static double benchLegacy(const unsigned char *payload, long size) {
+    long bytes = 0;
+    double start = now();
+    do {
+        for (long off = 0; off < size; off += MAX_PAYLOAD_SIZE) {
+            int chunk = (size - off < MAX_PAYLOAD_SIZE) ? size - off : MAX_PAYLOAD_SIZE;
+            int oldFrameSize, newFrameSize;
+            unsigned char *oldFrame = legacyBuildFrame(payload + off, chunk, &oldFrameSize);
+            unsigned char *newFrame = legacyByteStuffing(oldFrame, oldFrameSize, &newFrameSize);
+            sink += newFrame[newFrameSize / 2];
+            free(oldFrame);
+            free(newFrame);
+        }
+        bytes += size;
+    } while (now() - start < MIN_BENCH_TIME);
+    return (now() - start) * 1e9 / bytes;
+}
+
+static double benchEncoder(const unsigned char *payload, long size, LinkLayerFcs fcs) {
+    static unsigned char frame[MAX_FRAME_SIZE(MAX_PAYLOAD_SIZE)];
+    long bytes = 0;
+    double start = now();
+    do {
+        for (long off = 0; off < size; off += MAX_PAYLOAD_SIZE) {
+            int chunk = (size - off < MAX_PAYLOAD_SIZE) ? size - off : MAX_PAYLOAD_SIZE;
+            int frameSize = encodeFrame(frame, 0x03, 0x00, payload + off, chunk, fcs, LlByteStuffing);
+            sink += frame[frameSize / 2];
+        }
+        bytes += size;
+    } while (now() - start < MIN_BENCH_TIME);
+    return (now() - start) * 1e9 / bytes;
+}
+
+static void runBench(const char *name, const unsigned char *payload, long size) {
+    printf("%-14s %8ld bytes  legacy %6.3f ns/B  | encodeFrame bcc2 %6.3f  crc16 %6.3f  crc32 %6.3f ns/B\n",
+           name, size, benchLegacy(payload, size),
+           benchEncoder(payload, size, LlFcsBcc2),
+           benchEncoder(payload, size, LlFcsCrc16),
+           benchEncoder(payload, size, LlFcsCrc32));
+}
+
+// Unstuffing as done by the deframer: SIMD scan for FLAG/ESC, bulk copy of the runs
+static int unstuffField(unsigned char *out, const unsigned char *field, int size) {
+    unsigned char *start = out;
+    int i = 0;
+    while (i < size) {
+        int run = findFlagOrEsc(field + i, size - i);
+        memcpy(out, field + i, run);
+        out += run;
+        i += run;
+        if (i + 1 < size) *out++ = field[i + 1] ^ 0x20;
+        i += 2;
+    }
+    return out - start;
+}
+
+// Frames the payload as consecutive MAX_PAYLOAD_SIZE frames with a BCC2, so the FCS
+// costs next to nothing, and decodes their information fields. Returns ns per payload
+// byte for both and the frame bytes added per information field byte in *overhead.
+static void benchFraming(const unsigned char *payload, long size, LinkLayerFraming framing,
+                         double *encodeNs, double *decodeNs, double *overhead) {
+    long frames = (size + MAX_PAYLOAD_SIZE - 1) / MAX_PAYLOAD_SIZE;
+    unsigned char *encoded = malloc(frames * MAX_FRAME_SIZE(MAX_PAYLOAD_SIZE));
+    int *frameSizes = malloc(frames * sizeof(int));
+    static unsigned char field[MAX_PAYLOAD_SIZE + MAX_FCS_SIZE];
+
+    long bytes = 0, frameBytes = 0;
+    double start = now();
+    do {
+        unsigned char *frame = encoded;
+        frameBytes = 0;
+        for (long f = 0; f < frames; f++) {
+            long off = f * MAX_PAYLOAD_SIZE;
+            int chunk = (size - off < MAX_PAYLOAD_SIZE) ? size - off : MAX_PAYLOAD_SIZE;
+            frameSizes[f] = encodeFrame(frame, 0x03, 0x00, payload + off, chunk, LlFcsBcc2, framing);
+            frameBytes += frameSizes[f];
+            frame += frameSizes[f];
+        }
+        bytes += size;
+    } while (now() - start < MIN_BENCH_TIME);
+    *encodeNs = (now() - start) * 1e9 / bytes;
+    // Information field and FCS, against header, flags and what the framing added
+    *overhead = (double)(frameBytes - 5 * frames - (size + frames)) / (size + frames);
+
+    bytes = 0;
+    start = now();
+    do {
+        unsigned char *frame = encoded;
+        for (long f = 0; f < frames; f++) {
+            int fieldSize = frameSizes[f] - 5;
+            if (framing == LlCobs) {
+                CobsDecoder decoder = {0, 0};
+                sink += cobsDecode(&decoder, field, frame + 4, fieldSize);
+            } else {
+                sink += unstuffField(field, frame + 4, fieldSize);
+            }
+            frame += frameSizes[f];
+        }
+        bytes += size;
+    } while (now() - start < MIN_BENCH_TIME);
+    *decodeNs = (now() - start) * 1e9 / bytes;
+
+    free(encoded);
+    free(frameSizes);
+}
+
+// Decodes a frame from encodeFrame or encodeFecFrame the way the receiver does: unstuff
+// or COBS decode, corrupt as many bytes of the first FEC block as the parity can fix,
+// then checkInfoField. Returns the payload size at the start of field, or -1.
+static int decodeFrame(unsigned char *field, const unsigned char *frame, int length, LinkLayerFraming framing,
+                       LinkLayerFcs fcs, int parity, int maxPayload, int *corrected) {
+    int fieldSize;
+    if (framing == LlCobs) {
+        CobsDecoder decoder = {0, 0};
+        fieldSize = cobsDecode(&decoder, field, frame + 4, length - 5);
+    } else {
+        fieldSize = unstuffField(field, frame + 4, length - 5);
+    }
+    if (parity > 0) {
+        int blockSize = (fieldSize < RS_BLOCK_SIZE) ? fieldSize : RS_BLOCK_SIZE;
+        for (int e = 0; e < parity / 2; e++) field[(e * 37) % blockSize] ^= 0x5A;
+    }
+    uint32_t acc = fcsUpdate(fcs, fcsStart(fcs), field, fieldSize);
+    *corrected = 0;
+    return checkInfoField(field, fieldSize, acc, fcs, parity, maxPayload, corrected);
+}
+
+static int encodeTestFrame(unsigned char *frame, const unsigned char *data, int size, LinkLayerFraming framing,
+                           LinkLayerFcs fcs, int parity) {
+    return (parity > 0) ? encodeFecFrame(frame, 0x03, 0x00, data, size, fcs, parity, framing)
+                        : encodeFrame(frame, 0x03, 0x00, data, size, fcs, framing);
+}
+
+static void reportFailure(int *failures, const char *error, LinkLayerFraming framing, LinkLayerFcs fcs,
+                          int parity, int frameSize, long off) {
+    if (*failures == 0) {
+        printf("round trip failed: %s (%s, fcs %d, parity %d, %d byte frames at offset %ld)\n",
+               error, framing == LlCobs ? "cobs" : "stuffing", fcs, parity, frameSize, off);
+    }
+    (*failures)++;
+}
+
+// Encodes the payload in frames of frameSize bytes, decodes each and compares it with
+// the payload. The encoded field must also fit the receiver's buffer. Then a frame 100
+// bytes over frameSize, correct otherwise, must be refused with frameSize negotiated.
+// Returns the number of failures.
+static int checkRoundTrip(const unsigned char *payload, long size, int frameSize,
+                          LinkLayerFraming framing, LinkLayerFcs fcs, int parity) {
+    unsigned char *frame = malloc(MAX_FEC_FRAME_SIZE(frameSize + 100, parity));
+    unsigned char *field = malloc(MAX_FEC_FRAME_SIZE(frameSize + 100, parity));
+    // As sized in llconnopen for the largest parity, without the parity frame header
+    int capacity = COBS_FIELD_SIZE(FEC_FIELD_SIZE(frameSize + MAX_FCS_SIZE, RS_MAX_PARITY));
+    int failures = 0;
+
+    for (long off = 0; off < size; off += frameSize) {
+        int chunk = (size - off < frameSize) ? size - off : frameSize;
+        int length = encodeTestFrame(frame, payload + off, chunk, framing, fcs, parity);
+        int encodedSize = length - 5;
+        const char *error = NULL;
+
+        if (frame[0] != FLAG || frame[length - 1] != FLAG || frame[3] != (0x03 ^ 0x00)) error = "bad header or flags";
+        else if (memchr(frame + 4, FLAG, encodedSize) != NULL) error = "FLAG inside the field";
+        else if (framing == LlCobs && encodedSize > capacity) error = "field larger than the receive buffer";
+
+        if (error == NULL) {
+            int corrected;
+            int decoded = decodeFrame(field, frame, length, framing, fcs, parity, frameSize, &corrected);
+            if (decoded < 0) error = "FCS or FEC check failed";
+            else if (parity > 0 && corrected != parity / 2) error = "FEC did not correct the field";
+            else if (decoded != chunk) error = "wrong decoded size";
+            else if (memcmp(field, payload + off, chunk) != 0) error = "payload mismatch";
+        }
+        if (error != NULL) reportFailure(&failures, error, framing, fcs, parity, frameSize, off);
+    }
+
+    if (size >= frameSize + 100) {
+        int corrected;
+        int length = encodeTestFrame(frame, payload, frameSize + 100, framing, fcs, parity);
+        if (decodeFrame(field, frame, length, framing, fcs, parity, frameSize, &corrected) >= 0)
+            reportFailure(&failures, "frame over the negotiated size accepted", framing, fcs, parity, frameSize, 0);
+    }
+
+    free(frame);
+    free(field);
+    return failures;
+}
+
+// All combinations over the payload, in default and largest negotiable frames
+static int checkRoundTrips(const char *name, const unsigned char *payload, long size) {
+    int frameSizes[] = {MAX_PAYLOAD_SIZE, MAX_NEGOTIATED_PAYLOAD_SIZE};
+    int parities[] = {0, 8, RS_MAX_PARITY};
+    int failures = 0, checks = 0;
+    for (int s = 0; s < 2; s++) {
+        for (LinkLayerFraming framing = LlByteStuffing; framing <= LlCobs; framing++) {
+            for (LinkLayerFcs fcs = LlFcsBcc2; fcs <= LlFcsCrc32; fcs++) {
+                for (int p = 0; p < 3; p++) {
+                    failures += checkRoundTrip(payload, size, frameSizes[s], framing, fcs, parities[p]);
+                    checks++;
+                }
+            }
+        }
+    }
+    printf("%-14s round trip and oversize frames, %d combinations: %s\n", name, checks, failures ? "FAILED" : "ok");
+    return failures;
+}
+
+// Compresses the payload into blocks of at most blockSize bytes, filling the encoder
+// the way the application layer reads the file, and decompresses them in order.
+// Returns 0 if the stream comes back unchanged, 1 otherwise.
+static int checkLzRoundTrip(const unsigned char *payload, long size, LzCodec codec, int blockSize,
+                            long *compressedSize) {
+    LzEncoder *encoder = lzEncoderCreate(codec);
+    LzDecoder *decoder = lzDecoderCreate();
+    unsigned char *block = malloc(blockSize);
+    const char *error = NULL;
+    long in = 0, out = 0;
+    *compressedSize = 0;
+
+    if (encoder == NULL || decoder == NULL || block == NULL) error = "out of memory";
+    while (error == NULL && (in < size || lzPending(encoder) > 0)) {
+        int room;
+        unsigned char *input = lzInput(encoder, &room);
+        if (room > size - in) room = size - in;
+        if (room > 0 && (room >= LZ_MAX_BLOCK / 2 || room == size - in)) {
+            memcpy(input, payload + in, room);
+            lzAppend(encoder, room);
+            in += room;
+        }
+
+        int compressed;
+        int length = lzCompress(encoder, block, blockSize, &compressed);
+        const unsigned char *data;
+        int decoded = lzDecompress(decoder, block, length, compressed, &data);
+        *compressedSize += length;
+
+        if (length <= 0 || length > blockSize) error = "bad block size";
+        else if (decoded < 0) error = "block reported corrupt";
+        else if (decoded > size - out || memcmp(data, payload + out, decoded) != 0) error = "payload mismatch";
+        out += (decoded > 0) ? decoded : 0;
+    }
+    if (error == NULL && out != size) error = "wrong decompressed size";
+    if (error != NULL) {
+        printf("lz round trip failed: %s (%s, %d byte blocks at offset %ld)\n",
+               error, codec == LzFast ? "fast" : "dense", blockSize, out);
+    }
+
+    lzEncoderFree(encoder);
+    lzDecoderFree(decoder);
+    free(block);
+    return error != NULL;
+}
+
+// Both codecs, in the data size of default and largest negotiable packets
+static int checkLzRoundTrips(const char *name, const unsigned char *payload, long size) {
+    int blockSizes[] = {MAX_PAYLOAD_SIZE - 3, MAX_NEGOTIATED_PAYLOAD_SIZE - 3};
+    long compressedSizes[2][2];
+    int failures = 0;
+    for (int s = 0; s < 2; s++) {
+        failures += checkLzRoundTrip(payload, size, LzFast, blockSizes[s], &compressedSizes[s][0]);
+        failures += checkLzRoundTrip(payload, size, LzDense, blockSizes[s], &compressedSizes[s][1]);
+    }
+    printf("%-14s lz round trips, ratio fast %5.1f%% dense %5.1f%% (%d byte blocks): %s\n", name,
+           100.0 * compressedSizes[0][0] / size, 100.0 * compressedSizes[0][1] / size, blockSizes[0],
+           failures ? "FAILED" : "ok");
+    return failures;
+}
+
+static void runFramingBench(const char *name, const unsigned char *payload, long size) {
+    double stuffEncode, stuffDecode, stuffOverhead, cobsEncode, cobsDecode, cobsOverhead;
+    benchFraming(payload, size, LlByteStuffing, &stuffEncode, &stuffDecode, &stuffOverhead);
+    benchFraming(payload, size, LlCobs, &cobsEncode, &cobsDecode, &cobsOverhead);
+    printf("%-14s stuffing encode %6.3f decode %6.3f ns/B overhead %6.2f%%  | cobs encode %6.3f decode %6.3f ns/B overhead %5.2f%%\n",
+           name, stuffEncode, stuffDecode, 100 * stuffOverhead, cobsEncode, cobsDecode, 100 * cobsOverhead);
+}
+
+// Reed-Solomon over full 255-byte blocks, returns ns per data byte.
+// errors > 0 corrupts that many bytes of every block before decoding.
+static double benchRs(const unsigned char *payload, long size, int parity, int errors, int decode) {
+    unsigned char block[RS_BLOCK_SIZE];
+    int blockData = RS_BLOCK_SIZE - parity;
+    long bytes = 0;
+    double start = now();
+    do {
+        for (long off = 0; off + blockData <= size; off += blockData) {
+            memcpy(block, payload + off, blockData);
+            rsEncode(block, blockData, block + blockData, parity);
+            if (decode) {
+                for (int e = 0; e < errors; e++) block[(e * 37) % RS_BLOCK_SIZE] ^= 0x5A;
+                sink += rsDecode(block, RS_BLOCK_SIZE, parity);
+            }
+            bytes += blockData;
+        }
+    } while (now() - start < MIN_BENCH_TIME);
+    return (now() - start) * 1e9 / bytes;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = (argc > 1) ? argv[1] : "penguin.gif";
+    framingInit();
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+    unsigned char *gif = malloc(1 << 20);
+    long gifSize = fread(gif, 1, 1 << 20, file);
+    fclose(file);
+
+    long mbSize = 1 << 20;
+    unsigned char *random = malloc(mbSize);
+    srand(1);
+    for (long i = 0; i < mbSize; i++) random[i] = rand() & 0xFF;
+
+    // Worst case for byte stuffing
+    unsigned char *flags = malloc(mbSize);
+    memset(flags, FLAG, mbSize);
+
+    int failures = checkRoundTrips(path, gif, gifSize) + checkRoundTrips("1 MB random", random, mbSize) +
+                   checkRoundTrips("1 MB of 0x7E", flags, mbSize);
+    failures += checkLzRoundTrips(path, gif, gifSize) + checkLzRoundTrips("1 MB random", random, mbSize) +
+                checkLzRoundTrips("1 MB of 0x7E", flags, mbSize);
+    if (failures > 0) return 1;
+
+    runBench(path, gif, gifSize);
+    runBench("1 MB random", random, mbSize);
+
+    runFramingBench(path, gif, gifSize);
+    runFramingBench("1 MB random", random, mbSize);
+    runFramingBench("1 MB of 0x7E", flags, mbSize);
+
+    // 4 Mbit/s moves a byte every 2500 ns, the codec must stay well below that
+    for (int parity = 8; parity <= 32; parity *= 2) {
+        double encode = benchRs(random, mbSize, parity, 0, 0);
+        printf("rs parity %-4d encode %7.1f ns/B  decode clean %7.1f ns/B  with %d errors %7.1f ns/B\n",
+               parity, encode, benchRs(random, mbSize, parity, 0, 1) - encode, parity / 2,
+               benchRs(random, mbSize, parity, parity / 2, 1) - encode);
+    }
+
+    free(gif);
+    free(random);
+    free(flags);
+    return 0;
+}
@@ -0,0 +1,23 @@
+// Cyclic redundancy checks used as frame check sequence.
+
+#ifndef _CRC_H_
+#define _CRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-16/X.25 (HDLC FCS-16): reflected polynomial 0x1021, initial value and final XOR 0xFFFF.
+// CRC-32C (Castagnoli): reflected polynomial 0x1EDC6F41, initial value and final XOR 0xFFFFFFFF.
+#define CRC16_INIT 0xFFFF
+#define CRC32_INIT 0xFFFFFFFF
+
+// Build the lookup tables and pick the fastest implementation for this CPU.
+// Must be called before any update; later calls, from any thread, have no effect.
+void crcInit();
+
+// Continue a CRC over size bytes of data. The value returned is the running register,
+// the transmitted check value is its complement (~crc), least significant byte first.
+uint16_t crc16Update(uint16_t crc, const unsigned char *data, size_t size);
+uint32_t crc32Update(uint32_t crc, const unsigned char *data, size_t size);
+
+#endif // _CRC_H_
@@ -0,0 +1,106 @@
+// Frame encoding helpers shared by the link layer.
+
+#ifndef _FRAMING_H_
+#define _FRAMING_H_
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "link_layer.h"
+#include "rs.h"
+
+#define FLAG 0x7E // Frame delimiter
+#define ESC 0x7D  // Byte stuffing escape, the next byte is XORed with 0x20
+
+#define MAX_FCS_SIZE 4
+
+// Worst case length of a stuffed frame with an information field of size bytes
+// (every information and FCS byte escaped). COBS frames are always shorter.
+#define MAX_FRAME_SIZE(size) (5 + 2 * ((size) + MAX_FCS_SIZE))
+
+// Length of size bytes once split into Reed-Solomon blocks with parity bytes each
+#define FEC_FIELD_SIZE(size, parity) \
+    ((size) + ((size) + RS_BLOCK_SIZE - (parity) - 1) / (RS_BLOCK_SIZE - (parity)) * (parity))
+
+// Worst case length of a stuffed frame whose information field carries FEC parity
+#define MAX_FEC_FRAME_SIZE(size, parity) (5 + 2 * FEC_FIELD_SIZE((size) + MAX_FCS_SIZE, parity))
+
+// Worst case length of size bytes once COBS encoded: one code byte per 254 data bytes
+// and one for the first block
+#define COBS_FIELD_SIZE(size) ((size) + (size) / 254 + 1)
+
+// Builds the FCS and Reed-Solomon tables and selects the SIMD kernels supported by the CPU.
+// Must be called before using the functions below; later calls, from any thread, have no effect.
+void framingInit();
+
+// Frame check sequence over the information field.
+int fcsLength(LinkLayerFcs type);
+uint32_t fcsStart(LinkLayerFcs type);
+uint32_t fcsUpdate(LinkLayerFcs type, uint32_t acc, const unsigned char *data, int size);
+void fcsAppend(LinkLayerFcs type, uint32_t acc, unsigned char *out);
+// Value of the running FCS after a correct information field and its FCS
+uint32_t fcsResidue(LinkLayerFcs type);
+
+// Index of the first FLAG or ESC in data, or size if there is none.
+// Scans 32 (AVX2) or 16 (SSE2) bytes at a time when available.
+int findFlagOrEsc(const unsigned char *data, int size);
+
+// Byte-stuffs size bytes of data into out, returns the end of the written bytes.
+// Runs without FLAG/ESC are copied in bulk.
+unsigned char *stuffBytes(unsigned char *out, const unsigned char *data, int size);
+
+// COBS without FLAG instead of without zero: the information field is cut at each FLAG
+// into blocks of up to 254 bytes, each preceded by its length + 1 XOR FLAG. A FLAG is
+// implied between blocks, except after a full one. The encoder keeps the open block.
+typedef struct {
+    unsigned char *code; // Where the code byte of the open block goes
+    int length;          // Code byte and data bytes of the open block
+} CobsEncoder;
+
+// Opens the first block at out, returns where the data goes.
+unsigned char *cobsBegin(CobsEncoder *e, unsigned char *out);
+// Encodes size more bytes of the information field, returns the end of the written bytes.
+unsigned char *cobsBytes(CobsEncoder *e, unsigned char *out, const unsigned char *data, int size);
+// Writes the code byte of the last block.
+void cobsEnd(CobsEncoder *e);
+
+// Decoder state, both fields zero at the start of an information field
+typedef struct {
+    int left;        // Data bytes left in the current block, 0 before a code byte
+    int flagPending; // The FLAG implied by the previous block, written before the next code
+} CobsDecoder;
+
+// Decodes size bytes of an information field (without the closing FLAG) into out,
+// which may be data itself. Returns the number of bytes written, at most size.
+int cobsDecode(CobsDecoder *d, unsigned char *out, const unsigned char *data, int size);
+
+// Builds a complete frame with an information field in a single pass: the FCS is
+// computed on each block right before it is stuffed (or COBS encoded) into out, which
+// must hold MAX_FRAME_SIZE(size) bytes. Returns the frame length.
+int encodeFrame(unsigned char *out, unsigned char addr, unsigned char ctrl,
+                const unsigned char *data, int size, LinkLayerFcs fcs, LinkLayerFraming framing);
+
+// Same as encodeFrame, with the information field gathered from count pieces.
+int encodeFrameV(unsigned char *out, unsigned char addr, unsigned char ctrl,
+                 const struct iovec *pieces, int count, LinkLayerFcs fcs, LinkLayerFraming framing);
+
+// Same as encodeFrame, but the information field and its FCS are cut into blocks of
+// RS_BLOCK_SIZE - parity bytes, each followed by its Reed-Solomon parity, before
+// stuffing. out must hold MAX_FEC_FRAME_SIZE(size, parity) bytes.
+int encodeFecFrame(unsigned char *out, unsigned char addr, unsigned char ctrl,
+                   const unsigned char *data, int size, LinkLayerFcs fcs, int parity,
+                   LinkLayerFraming framing);
+
+// Corrects an information field built by encodeFecFrame in place and removes the
+// parity. Returns the remaining size (data and FCS), or -1 if a block has too many
+// errors. The number of bytes corrected is added to *corrected.
+int decodeFecField(unsigned char *field, int size, int parity, int *corrected);
+
+// Checks a received information field (unstuffed or COBS decoded): corrects it with
+// decodeFecField if parity > 0, then checks and removes the FCS. acc is the FCS run over
+// the field as received, used without parity. Returns the payload size, or -1 if the
+// field is corrupt or its payload is longer than maxPayload.
+int checkInfoField(unsigned char *field, int size, uint32_t acc, LinkLayerFcs fcs, int parity,
+                   int maxPayload, int *corrected);
+
+#endif // _FRAMING_H_
@@ -1,5 +1,6 @@
 // Link layer header.
-// NOTE: This file must not be changed.
+// NOTE: The original functions (llopen, llwrite, llread, llclose) keep their
+// signatures, main.c and the application layer are written against them.
 
 #ifndef _LINK_LAYER_H_
 #define _LINK_LAYER_H_
@@ -7,7 +8,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <signal.h>
+#include <sys/uio.h>
 
 typedef enum
 {
@@ -15,6 +16,27 @@ typedef enum
     LlRx,
 } LinkLayerRole;
 
+typedef enum
+{
+    LlGoBackN,
+    LlSelectiveRepeat,
+} LinkLayerArq;
+
+// Frame check sequence protecting the information field
+typedef enum
+{
+    LlFcsBcc2,  // XOR of all bytes (1 byte)
+    LlFcsCrc16, // CRC-16/X.25 (2 bytes)
+    LlFcsCrc32, // CRC-32C (4 bytes)
+} LinkLayerFcs;
+
+// How FLAG bytes are kept out of the information field
+typedef enum
+{
+    LlByteStuffing, // ESC followed by the byte XOR 0x20, up to twice the size
+    LlCobs,         // Consistent Overhead Byte Stuffing, at most 1 byte per 254
+} LinkLayerFraming;
+
 typedef enum {
     START,
     FLAG_RCV, 
@@ -30,13 +52,35 @@ typedef struct
     LinkLayerRole role;
     int baudRate;
     int nRetransmissions;
-    int timeout;
+    int timeout;   // Retransmission timeout in seconds
+    int timeoutMs; // Retransmission timeout in milliseconds, used instead of timeout when > 0
+    int windowSize; // Frames in flight (1 = stop-and-wait, up to MAX_WINDOW_SIZE)
+    LinkLayerArq arq; // Recovery used when windowSize > 1
+    LinkLayerFcs fcs; // Proposed in SET, the strongest of both ends is used
+    int maxPayloadSize; // Largest information field proposed in SET, the smallest of both ends is used
+    int fecParity; // Reed-Solomon parity bytes per 255-byte block of I-frames (0 = off), the larger end wins
+    int parityGroup; // I-frames per XOR parity frame (0 = off), Selective Repeat only
+    int fullDuplex; // Both ends may send data, acknowledgements ride on I-frames (if both ends ask)
+    LinkLayerFraming framing; // Of I-frames and parity frames, COBS is used if both ends ask
+    const char *statsFile; // llclose appends its statistics here as a JSON line (NULL or "" = off)
 } LinkLayer;
 
 // SIZE of maximum acceptable payload.
 // Maximum number of bytes that application layer should send to link layer
+// unless a larger size is negotiated (see llmaxpayload)
 #define MAX_PAYLOAD_SIZE 1000
 
+// Largest information field that can be negotiated
+#define MAX_NEGOTIATED_PAYLOAD_SIZE 65535
+
+// Largest sliding window (sequence numbers are modulo 8 when windowSize > 1)
+// Selective Repeat is limited to half the sequence space
+#define MAX_WINDOW_SIZE 7
+#define MAX_SR_WINDOW_SIZE 4
+
+// Most I-frames covered by one parity frame
+#define MAX_PARITY_GROUP 4
+
 // MISC
 #define FALSE 0
 #define TRUE 1
@@ -45,17 +89,59 @@ typedef struct
 // Return "1" on success or "-1" on error.
 int llopen(LinkLayer connectionParameters);
 
+// Largest bufSize accepted by llwrite and packet size returned by llread,
+// as negotiated by llopen.
+int llmaxpayload();
+
+// Payload size that currently gives the best throughput, at most llmaxpayload().
+// Shrinks as frames are rejected or time out and grows back on a clean link.
+// If errorRate is not NULL it receives the recent fraction of frames repeated.
+int llrecommendedpayload(double *errorRate);
+
 // Send data in buf with size bufSize.
 // Return number of chars written, or "-1" on error.
 int llwrite(const unsigned char *buf, int bufSize);
 
+// Same as llwrite with the packet gathered from count pieces, so a header and data
+// kept elsewhere (a mapped file) are framed without copying them together first.
+int llwritev(const struct iovec *pieces, int count);
+
 // Receive data in packet.
 // Return number of chars read, or "-1" on error.
 int llread(unsigned char *packet);
 
+// TRUE if llread can return a packet without waiting, which with full duplex lets one
+// end interleave llwrite and llread. Returns "-1" when the link failed.
+int llpending();
+
 // Close previously opened connection.
 // if showStatistics == TRUE, link layer should print statistics in the console on close.
+// If statsFile was set in llopen, the statistics are also appended there as JSON.
 // Return "1" on success or "-1" on error.
 int llclose(int showStatistics);
 
+// The functions above drive a single default connection. The ones below take the
+// connection as a handle, so that one process can run several links at once
+// (one thread per connection, a connection must not be shared between threads).
+typedef struct LinkConnection LinkConnection;
+
+// Same as llopen, returns the new connection or NULL on error.
+LinkConnection *llconnopen(LinkLayer connectionParameters);
+
+// Same as llmaxpayload, llrecommendedpayload, llwrite, llwritev, llread and llpending
+// for connection c.
+int llconnmaxpayload(LinkConnection *c);
+int llconnrecommendedpayload(LinkConnection *c, double *errorRate);
+int llconnwrite(LinkConnection *c, const unsigned char *buf, int bufSize);
+int llconnwritev(LinkConnection *c, const struct iovec *pieces, int count);
+int llconnread(LinkConnection *c, unsigned char *packet);
+int llconnpending(LinkConnection *c);
+
+// Wait until every frame written on c is acknowledged (transmitter only).
+// Return "1" on success or "-1" when the maximum number of retransmissions is reached.
+int llconnflush(LinkConnection *c);
+
+// Same as llclose. The connection is freed whatever the result.
+int llconnclose(LinkConnection *c, int showStatistics);
+
 #endif // _LINK_LAYER_H_
@@ -0,0 +1,55 @@
+// Streaming LZ77 compression of the file data, in the LZ4 block format.
+
+#ifndef _LZ_H_
+#define _LZ_H_
+
+// Codecs, as advertised in the START packet
+typedef enum {
+    LzNone,
+    LzFast,  // One hash probe per position, LZ4 speed
+    LzDense, // Hash chains and lazy matching, smaller output for slow links
+} LzCodec;
+
+// Matches reach back at most this far into the stream, across blocks
+#define LZ_WINDOW_SIZE 65536
+
+// Most input bytes waiting to be compressed, and so in one block once decompressed
+#define LZ_MAX_BLOCK 65536
+
+// The encoder keeps the stream since the start of the window; each block holds as
+// much of the pending input as fits in the room given, so blocks can be cut to the
+// size of a packet and still use the repetitions of the packets before them.
+typedef struct LzEncoder LzEncoder;
+typedef struct LzDecoder LzDecoder;
+
+// Returns NULL if out of memory.
+LzEncoder *lzEncoderCreate(LzCodec codec);
+void lzEncoderFree(LzEncoder *e);
+
+// Starts a new encoder with the last LZ_WINDOW_SIZE bytes of history as the stream
+// before its input, for blocks that a decoder holding that stream will follow.
+void lzPrime(LzEncoder *e, const unsigned char *history, int size);
+
+// Room for more input (up to LZ_MAX_BLOCK pending bytes), for read() to fill directly.
+// lzAppend() then takes size bytes written there.
+unsigned char *lzInput(LzEncoder *e, int *room);
+void lzAppend(LzEncoder *e, int size);
+
+// Input bytes not compressed yet
+int lzPending(LzEncoder *e);
+
+// Compresses pending input into a block of at most capacity bytes at out.
+// Returns the block size; the input it did not take stays pending.
+// Input that looks random or would not shrink is stored as is, *compressed = 0.
+int lzCompress(LzEncoder *e, unsigned char *out, int capacity, int *compressed);
+
+// Returns NULL if out of memory.
+LzDecoder *lzDecoderCreate();
+void lzDecoderFree(LzDecoder *d);
+
+// Decompresses one block, or takes a stored one as is (compressed = 0). *out points
+// to the bytes it held, valid until the next call. Returns their number, or -1 if
+// the block is corrupt.
+int lzDecompress(LzDecoder *d, const unsigned char *block, int size, int compressed, const unsigned char **out);
+
+#endif // _LZ_H_
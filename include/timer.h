@@ -0,0 +1,26 @@
+// Retransmission timers with millisecond resolution.
+// Each timer is a timerfd, so it can be waited on with poll() next to the serial port.
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+// Create a stopped timer.
+// Returns its file descriptor, or -1 on error.
+int createTimer();
+
+// Arm the timer to expire once after ms milliseconds, replacing any earlier deadline.
+void startTimer(int timer, long ms);
+
+// Disarm the timer, an expiration not consumed yet is discarded.
+void stopTimer(int timer);
+
+// Consume the expiration of a timer that poll() reported readable.
+// Returns 1 if the timer expired, 0 otherwise.
+int timerExpired(int timer);
+
+void destroyTimer(int timer);
+
+// Current CLOCK_MONOTONIC time in microseconds, for measuring round trips.
+long long monotonicTimeUs();
+
+#endif // _TIMER_H_
@@ -1,9 +1,100 @@
 #include "../include/application_layer.h"
 #include "../include/link_layer.h"
+#include "../include/lz.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #define C_DATA 1
 #define C_START 2
 #define C_END 3
+#define C_CHUNK 4 // Data at a file offset, for bonded transfers
+#define C_STORED 0x80 // With C_DATA: the data was not compressed
+
+// Bonded transfers: several serial ports, comma separated, share one file
+#define MAX_BONDED_LINKS 8
+#define CHUNK_HEADER_SIZE 11 // C_CHUNK, 2 byte length, 8 byte offset
+
+// Bytes of a mapped file the kernel is asked to read in ahead of the packets
+#define READ_AHEAD (4 << 20)
+
+// Received data is written in blocks of this size, page aligned
+#define SINK_BUFFER_SIZE (1 << 20)
+
+// Link layer sliding window (1 = stop-and-wait); override with -DWINDOW_SIZE=n
+#ifndef WINDOW_SIZE
+#define WINDOW_SIZE 1
+#endif
+
+// Window recovery mode, LlGoBackN or LlSelectiveRepeat
+#ifndef ARQ_MODE
+#define ARQ_MODE LlGoBackN
+#endif
+
+// Frame check sequence, LlFcsBcc2, LlFcsCrc16 or LlFcsCrc32
+#ifndef FCS_TYPE
+#define FCS_TYPE LlFcsCrc16
+#endif
+
+// Largest link layer information field to propose, up to MAX_NEGOTIATED_PAYLOAD_SIZE
+#ifndef PAYLOAD_SIZE
+#define PAYLOAD_SIZE MAX_PAYLOAD_SIZE
+#endif
+
+// Reed-Solomon parity bytes per 255-byte block (corrects half as many byte errors), 0 = off
+#ifndef FEC_PARITY
+#define FEC_PARITY 0
+#endif
+
+// I-frames per XOR parity frame, rebuilds one lost frame per group (Selective Repeat only)
+#ifndef PARITY_GROUP
+#define PARITY_GROUP 0
+#endif
+
+// Framing of I-frames: LlByteStuffing or LlCobs (bounded overhead, used if both ends ask)
+#ifndef FRAMING
+#define FRAMING LlByteStuffing
+#endif
+
+// Retransmission timeout in milliseconds, 0 keeps the timeout from main (in seconds)
+#ifndef TIMEOUT_MS
+#define TIMEOUT_MS 0
+#endif
+
+// Full duplex: the receiver sends DUPLEX_FILE back while it receives, the transmitter
+// stores it as DUPLEX_FILE.received. Both ends must set it; empty for one-way transfers.
+#ifndef DUPLEX_FILE
+#define DUPLEX_FILE ""
+#endif
+
+// Compression of the file data: LzNone, LzFast (LZ4 class) or LzDense (slower, smaller,
+// for low baud rates). Advertised in the START packet, the receiver follows it.
+#ifndef COMPRESSION
+#define COMPRESSION LzNone
+#endif
+
+// Threads compressing segments of the file ahead of the link, 0 = compress in the send
+// loop. At most COMPRESSION_QUEUE segments wait compressed or being compressed.
+#ifndef COMPRESSION_WORKERS
+#define COMPRESSION_WORKERS 0
+#endif
+#ifndef COMPRESSION_QUEUE
+#define COMPRESSION_QUEUE 8
+#endif
+
+// Receiver: fdatasync the output file at most this often while receiving, 0 syncs once
+// at the end only
+#ifndef SYNC_INTERVAL_MS
+#define SYNC_INTERVAL_MS 0
+#endif
+
+// llclose appends the link statistics to this file as one JSON object per line, so runs
+// with different settings can be compared. Empty to only print them.
+#ifndef STATS_FILE
+#define STATS_FILE ""
+#endif
 
 // Helper function to initialize link layer connection parameters
 LinkLayer initializeLinkLayer(const char* serialPort, LinkLayerRole role, int baudRate, int nTries, int timeout) {
@@ -14,6 +105,16 @@ LinkLayer initializeLinkLayer(const char* serialPort, LinkLayerRole role, int ba
     connectionParams.baudRate = baudRate;
     connectionParams.nRetransmissions = nTries;
     connectionParams.timeout = timeout;
+    connectionParams.timeoutMs = TIMEOUT_MS;
+    connectionParams.windowSize = WINDOW_SIZE;
+    connectionParams.arq = ARQ_MODE;
+    connectionParams.fcs = FCS_TYPE;
+    connectionParams.maxPayloadSize = PAYLOAD_SIZE;
+    connectionParams.fecParity = FEC_PARITY;
+    connectionParams.parityGroup = PARITY_GROUP;
+    connectionParams.fullDuplex = DUPLEX_FILE[0] != '\0';
+    connectionParams.framing = FRAMING;
+    connectionParams.statsFile = STATS_FILE;
     return connectionParams;
 }
 
@@ -31,67 +132,557 @@ unsigned char* constructControlPacket(unsigned char controlType, unsigned long f
     return controlPacket;
 }
 
+double secondsSince(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Tops up the compressor input from the file up to end, in reads of at least half its room
+int fillCompressor(LzEncoder *encoder, int fd, unsigned long end, unsigned long *bytesRemaining) {
+    int room;
+    unsigned char *input = lzInput(encoder, &room);
+    if ((unsigned long)room > *bytesRemaining) room = *bytesRemaining;
+    if (room == 0 || (room < LZ_MAX_BLOCK / 2 && (unsigned long)room < *bytesRemaining)) return 0;
+
+    ssize_t bytes = pread(fd, input, room, end - *bytesRemaining);
+    if (bytes <= 0) return -1;
+    lzAppend(encoder, bytes);
+    *bytesRemaining -= bytes;
+    return 0;
+}
+
+// File to send, mapped when possible so packets are framed straight from the page
+// cache; files that cannot be mapped are read into a buffer. Either way the size is
+// the one fstat gave, as announced in the START packet.
+typedef struct {
+    int fd;
+    unsigned long size;
+    unsigned long offset;    // Next byte to send
+    unsigned char *map;      // NULL when reading
+    unsigned long adviseEnd; // Read ahead asked up to here
+    unsigned char *buffer;
+} FileSource;
+
+int openFileSource(FileSource *source, int fd, unsigned long size, int bufferSize) {
+    memset(source, 0, sizeof(FileSource));
+    source->fd = fd;
+    source->size = size;
+    if (size > 0) {
+        void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            source->map = (unsigned char *) map;
+            madvise(source->map, size, MADV_SEQUENTIAL);
+            return 0;
+        }
+    }
+    source->buffer = (unsigned char *) malloc(bufferSize);
+    return (source->buffer != NULL) ? 0 : -1;
+}
+
+// Points *data to the next bytes of the file, at most maxSize. Returns their number,
+// 0 at the end of the file or -1 on a read error or if the file ends early.
+int nextFileSlice(FileSource *source, int maxSize, const unsigned char **data) {
+    unsigned long left = source->size - source->offset;
+    int size = (left < (unsigned long)maxSize) ? left : maxSize;
+    if (size == 0) return 0;
+
+    if (source->map == NULL) {
+        // Reads may return less than asked for, keep going until the slice is full
+        int done = 0;
+        while (done < size) {
+            ssize_t bytes = read(source->fd, source->buffer + done, size - done);
+            if (bytes < 0 && errno == EINTR) continue;
+            if (bytes <= 0) break;
+            done += bytes;
+        }
+        if (done == 0) return -1;
+        size = done;
+        *data = source->buffer;
+    } else {
+        if (source->adviseEnd < source->offset + READ_AHEAD / 2 && source->adviseEnd < source->size) {
+            // Pages ahead in big steps, the offset is page aligned
+            unsigned long length = (source->size - source->adviseEnd < READ_AHEAD) ? source->size - source->adviseEnd : READ_AHEAD;
+            madvise(source->map + source->adviseEnd, length, MADV_WILLNEED);
+            source->adviseEnd += length;
+        }
+        *data = source->map + source->offset;
+    }
+    source->offset += size;
+    return size;
+}
+
+void closeFileSource(FileSource *source) {
+    if (source->map != NULL) munmap(source->map, source->size);
+    free(source->buffer);
+}
+
+// File being received. Packets are gathered in two aligned buffers: while one fills,
+// a thread writes the other and syncs the file every SYNC_INTERVAL_MS.
+typedef struct {
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    unsigned char *buffers[2];
+    int filling;     // Buffer taking packets
+    int fill;        // Bytes in it
+    int flushSize;   // Bytes of the other buffer to write, 0 when it is free
+    int closing;
+    int error;       // errno of a failed write, kept for the next sinkWrite
+    unsigned long written;
+    unsigned long reserved; // Preallocated size
+    struct timespec lastSync;
+    int numWrites;
+    int numSyncs;
+} FileSink;
+
+void *flushFileSink(void *arg) {
+    FileSink *sink = (FileSink *) arg;
+    pthread_mutex_lock(&sink->lock);
+    while (TRUE) {
+        while (sink->flushSize == 0 && !sink->closing) pthread_cond_wait(&sink->changed, &sink->lock);
+        if (sink->flushSize == 0) break;
+        unsigned char *buffer = sink->buffers[1 - sink->filling];
+        int size = sink->flushSize;
+        pthread_mutex_unlock(&sink->lock);
+
+        int error = 0;
+        for (int done = 0; done < size && error == 0;) {
+            ssize_t bytes = write(sink->fd, buffer + done, size - done);
+            if (bytes < 0 && errno != EINTR) error = errno;
+            if (bytes > 0) done += bytes;
+        }
+        if (error == 0 && SYNC_INTERVAL_MS > 0 && secondsSince(&sink->lastSync) * 1000 >= SYNC_INTERVAL_MS) {
+            fdatasync(sink->fd);
+            clock_gettime(CLOCK_MONOTONIC, &sink->lastSync);
+            sink->numSyncs++;
+        }
+
+        pthread_mutex_lock(&sink->lock);
+        if (error != 0) sink->error = error;
+        else sink->written += size;
+        sink->numWrites++;
+        sink->flushSize = 0;
+        pthread_cond_broadcast(&sink->changed);
+    }
+    pthread_mutex_unlock(&sink->lock);
+    return NULL;
+}
+
+// Reserves expectedSize bytes on disk, so the file is laid out in one piece
+int openFileSink(FileSink *sink, int fd, unsigned long expectedSize) {
+    memset(sink, 0, sizeof(FileSink));
+    sink->fd = fd;
+    if (posix_memalign((void **) &sink->buffers[0], 4096, SINK_BUFFER_SIZE) != 0) return -1;
+    if (posix_memalign((void **) &sink->buffers[1], 4096, SINK_BUFFER_SIZE) != 0) {
+        free(sink->buffers[0]);
+        return -1;
+    }
+    // Not every file system or file can, the writes allocate as they go then
+    if (expectedSize > 0 && posix_fallocate(fd, 0, expectedSize) == 0) sink->reserved = expectedSize;
+
+    clock_gettime(CLOCK_MONOTONIC, &sink->lastSync);
+    pthread_mutex_init(&sink->lock, NULL);
+    pthread_cond_init(&sink->changed, NULL);
+    if (pthread_create(&sink->thread, NULL, flushFileSink, sink) != 0) {
+        free(sink->buffers[0]);
+        free(sink->buffers[1]);
+        return -1;
+    }
+    return 0;
+}
+
+// Hands the buffer being filled to the writing thread once it is free. Returns the
+// errno of a failed write so far, 0 if none.
+int swapFileSink(FileSink *sink) {
+    pthread_mutex_lock(&sink->lock);
+    while (sink->flushSize > 0) pthread_cond_wait(&sink->changed, &sink->lock);
+    int error = sink->error;
+    if (error == 0) {
+        sink->flushSize = sink->fill;
+        sink->filling = 1 - sink->filling;
+        sink->fill = 0;
+        pthread_cond_broadcast(&sink->changed);
+    }
+    pthread_mutex_unlock(&sink->lock);
+    return error;
+}
+
+// Returns -1 if a write failed, with errno set
+int sinkWrite(FileSink *sink, const unsigned char *data, int size) {
+    while (size > 0) {
+        int n = (size < SINK_BUFFER_SIZE - sink->fill) ? size : SINK_BUFFER_SIZE - sink->fill;
+        memcpy(sink->buffers[sink->filling] + sink->fill, data, n);
+        sink->fill += n;
+        data += n;
+        size -= n;
+        if (sink->fill == SINK_BUFFER_SIZE && (errno = swapFileSink(sink)) != 0) return -1;
+    }
+    return 0;
+}
+
+// Writes what is left, syncs once and trims a preallocation the data did not fill.
+// Returns -1 if a write failed, with errno set.
+int closeFileSink(FileSink *sink) {
+    if (sink->fill > 0) swapFileSink(sink);
+    pthread_mutex_lock(&sink->lock);
+    sink->closing = TRUE;
+    pthread_cond_broadcast(&sink->changed);
+    pthread_mutex_unlock(&sink->lock);
+    pthread_join(sink->thread, NULL);
+
+    if (sink->written < sink->reserved && ftruncate(sink->fd, sink->written) < 0) perror("Error trimming the output file");
+    if (fdatasync(sink->fd) == 0) sink->numSyncs++;
+    printf("Wrote %lu bytes in %d writes and %d syncs\n", sink->written, sink->numWrites, sink->numSyncs);
+
+    pthread_mutex_destroy(&sink->lock);
+    pthread_cond_destroy(&sink->changed);
+    free(sink->buffers[0]);
+    free(sink->buffers[1]);
+    errno = sink->error;
+    return (sink->error != 0) ? -1 : 0;
+}
+
+// Compresses data into one packet after the 3 byte header. Returns the data size.
+unsigned int compressPacket(LzEncoder *encoder, unsigned char *packet, unsigned int maxDataSize) {
+    int compressed;
+    unsigned int size = lzCompress(encoder, packet + 3, maxDataSize, &compressed);
+    packet[0] = compressed ? C_DATA : C_DATA | C_STORED;
+    packet[1] = (size >> 8) & 0xFF;
+    packet[2] = size & 0xFF;
+    return size;
+}
+
+////////////////////////////////////////////////
+// PARALLEL COMPRESSION
+////////////////////////////////////////////////
+
+// Worker threads compress the file in segments while the link sends the ones before.
+// Each worker starts its encoder with the window of file before its segment, which the
+// receiver has decoded by then, so the packets make one stream as from a single encoder.
+#define SEGMENT_SIZE (2 * LZ_MAX_BLOCK)
+
+typedef struct {
+    int done;
+    int failed;
+    unsigned char *packets; // Data packets back to back, headers included
+    int size;
+    int capacity;
+} Segment;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int fd;
+    unsigned long fileSize;
+    unsigned long numSegments;
+    unsigned long nextJob;    // First segment no worker took yet
+    unsigned long nextSend;   // Segment the link waits for
+    unsigned int maxDataSize; // For segments started from now
+    int stop;
+    Segment queue[COMPRESSION_QUEUE]; // Segment i in queue[i % COMPRESSION_QUEUE]
+} CompressionPipeline;
+
+// Returns -1 if the file cannot be read or memory runs out
+int compressSegment(CompressionPipeline *p, unsigned long index, unsigned int maxDataSize, Segment *segment) {
+    LzEncoder *encoder = lzEncoderCreate(COMPRESSION);
+    if (encoder == NULL) return -1;
+
+    unsigned long offset = index * SEGMENT_SIZE;
+    unsigned long end = (p->fileSize - offset < SEGMENT_SIZE) ? p->fileSize : offset + SEGMENT_SIZE;
+    if (offset > 0) {
+        int historySize = (offset < LZ_WINDOW_SIZE) ? offset : LZ_WINDOW_SIZE;
+        unsigned char *history = (unsigned char *) malloc(historySize);
+        if (history == NULL || pread(p->fd, history, historySize, offset - historySize) != historySize) {
+            free(history);
+            lzEncoderFree(encoder);
+            return -1;
+        }
+        lzPrime(encoder, history, historySize);
+        free(history);
+    }
+
+    unsigned long bytesRemaining = end - offset;
+    segment->size = 0;
+    while (bytesRemaining > 0 || lzPending(encoder) > 0) {
+        if (fillCompressor(encoder, p->fd, end, &bytesRemaining) < 0) break;
+        if (segment->capacity - segment->size < (int)maxDataSize + 3) {
+            int capacity = segment->capacity * 2 + maxDataSize + 3;
+            unsigned char *packets = (unsigned char *) realloc(segment->packets, capacity);
+            if (packets == NULL) break;
+            segment->packets = packets;
+            segment->capacity = capacity;
+        }
+        segment->size += compressPacket(encoder, segment->packets + segment->size, maxDataSize) + 3;
+    }
+
+    int status = (bytesRemaining > 0 || lzPending(encoder) > 0) ? -1 : 0;
+    lzEncoderFree(encoder);
+    return status;
+}
+
+void *compressionWorker(void *arg) {
+    CompressionPipeline *p = (CompressionPipeline *) arg;
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop && p->nextJob < p->numSegments) {
+        // Bounded look-ahead: the queue slot must have been sent
+        if (p->nextJob >= p->nextSend + COMPRESSION_QUEUE) {
+            pthread_cond_wait(&p->changed, &p->lock);
+            continue;
+        }
+        unsigned long index = p->nextJob++;
+        unsigned int maxDataSize = p->maxDataSize;
+        Segment *segment = &p->queue[index % COMPRESSION_QUEUE];
+        pthread_mutex_unlock(&p->lock);
+
+        int status = compressSegment(p, index, maxDataSize, segment);
+
+        pthread_mutex_lock(&p->lock);
+        segment->failed = (status < 0);
+        segment->done = TRUE;
+        pthread_cond_broadcast(&p->changed);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+// Sends the file compressed by COMPRESSION_WORKERS threads, in order. Returns the file
+// bytes sent, counting packets, stored packets and bytes on the link like the send loop.
+unsigned long transmitCompressedSegments(int fd, unsigned long fileSize, unsigned long *bytesSent,
+                                         int *numPackets, int *numStored) {
+    CompressionPipeline *p = (CompressionPipeline *) calloc(1, sizeof(CompressionPipeline));
+    if (p == NULL) {
+        perror("Error creating the compression pipeline");
+        return 0;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->changed, NULL);
+    p->fd = fd;
+    p->fileSize = fileSize;
+    p->numSegments = (fileSize + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+    double errorRate;
+    p->maxDataSize = llrecommendedpayload(&errorRate) - 3;
+    if (p->maxDataSize > 0xFFFF) p->maxDataSize = 0xFFFF;
+
+    pthread_t workers[(COMPRESSION_WORKERS > 0) ? COMPRESSION_WORKERS : 1]; // Unused without workers
+    int numWorkers = 0;
+    while (numWorkers < COMPRESSION_WORKERS &&
+           pthread_create(&workers[numWorkers], NULL, compressionWorker, p) == 0) numWorkers++;
+    if (numWorkers == 0) printf("Error: no compression worker started\n");
+
+    unsigned long bytesDone = 0;
+    int payloadSize = 0;
+    while (numWorkers > 0 && p->nextSend < p->numSegments) {
+        Segment *segment = &p->queue[p->nextSend % COMPRESSION_QUEUE];
+        pthread_mutex_lock(&p->lock);
+        while (!segment->done) pthread_cond_wait(&p->changed, &p->lock);
+        pthread_mutex_unlock(&p->lock);
+        if (segment->failed) {
+            perror("Error compressing the file");
+            break;
+        }
+
+        int error = FALSE;
+        for (int offset = 0; offset < segment->size;) {
+            // Follow the link layer's advice from the segments compressed next
+            int recommended = llrecommendedpayload(&errorRate);
+            if (recommended != payloadSize) {
+                printf("Packet size %d -> %d bytes (frame error rate %.4f)\n", payloadSize, recommended, errorRate);
+                payloadSize = recommended;
+                pthread_mutex_lock(&p->lock);
+                p->maxDataSize = (payloadSize - 3 > 0xFFFF) ? 0xFFFF : payloadSize - 3;
+                pthread_mutex_unlock(&p->lock);
+            }
+
+            unsigned char *packet = segment->packets + offset;
+            unsigned int chunkSize = (packet[1] << 8) | packet[2];
+            if (llwrite(packet, chunkSize + 3) != (int)(chunkSize + 3)) {
+                perror("Error sending data packet");
+                error = TRUE;
+                break;
+            }
+            printf("Sent data packet of size %u bytes\n", chunkSize);
+            *bytesSent += chunkSize;
+            (*numPackets)++;
+            if (packet[0] & C_STORED) (*numStored)++;
+            offset += chunkSize + 3;
+        }
+        if (error) break;
+        bytesDone += (fileSize - p->nextSend * SEGMENT_SIZE < SEGMENT_SIZE) ? fileSize - p->nextSend * SEGMENT_SIZE : SEGMENT_SIZE;
+
+        pthread_mutex_lock(&p->lock);
+        segment->done = FALSE;
+        p->nextSend++;
+        pthread_cond_broadcast(&p->changed);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = TRUE;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < numWorkers; i++) pthread_join(workers[i], NULL);
+
+    for (int i = 0; i < COMPRESSION_QUEUE; i++) free(p->queue[i].packets);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->changed);
+    free(p);
+    return bytesDone;
+}
+
 // Transmitter: sends data in packets along with START and END control packets
 void transmitFileData(int fd, unsigned long fileSize) {
-    unsigned char* startPacket = constructControlPacket(C_START, fileSize);
-    if (llwrite(startPacket, 11) == -1) {
+    int parallel = (COMPRESSION != LzNone && COMPRESSION_WORKERS > 0);
+    LzEncoder *encoder = NULL;
+    if (COMPRESSION != LzNone && !parallel && (encoder = lzEncoderCreate(COMPRESSION)) == NULL) {
+        perror("Error creating the compressor");
+        return;
+    }
+    FileSource source;
+    if (COMPRESSION == LzNone && openFileSource(&source, fd, fileSize, llmaxpayload()) < 0) {
+        perror("Error opening the file");
+        return;
+    }
+    struct timespec startTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+    unsigned char startPacket[14];
+    unsigned char* controlPacket = constructControlPacket(C_START, fileSize);
+    memcpy(startPacket, controlPacket, 11);
+    free(controlPacket);
+    int startSize = 11;
+    if (COMPRESSION != LzNone) {
+        startPacket[startSize++] = 2; // Codec TLV type
+        startPacket[startSize++] = 1;
+        startPacket[startSize++] = COMPRESSION;
+    }
+    if (llwrite(startPacket, startSize) == -1) {
         perror("Error sending START packet");
-        free(startPacket);
+        lzEncoderFree(encoder);
+        if (COMPRESSION == LzNone) closeFileSource(&source);
         return;
     }
-    free(startPacket);
 
-    unsigned char* dataPacket = (unsigned char*) calloc(MAX_PAYLOAD_SIZE, sizeof(unsigned char));
-    unsigned int maxDataSize = MAX_PAYLOAD_SIZE - 3;
-    unsigned long bytesRemaining = fileSize;
+    unsigned char* dataPacket = (unsigned char*) calloc(llmaxpayload(), sizeof(unsigned char));
+    int payloadSize = 0;
+    unsigned long bytesRemaining = fileSize; // Not read from the file yet
+    unsigned long bytesSent = 0;
+    int numPackets = 0;
+    int numStored = 0;
+    struct iovec pieces[2] = {{dataPacket, 3}, {NULL, 0}}; // Packet header, file slice
 
-    while (bytesRemaining > 0) {
-        unsigned int chunkSize = (bytesRemaining < maxDataSize) ? bytesRemaining : maxDataSize;
+    if (parallel) bytesRemaining -= transmitCompressedSegments(fd, fileSize, &bytesSent, &numPackets, &numStored);
 
-        dataPacket[0] = C_DATA;
-        dataPacket[1] = (chunkSize >> 8) & 0xFF;
-        dataPacket[2] = chunkSize & 0xFF;
+    while (!parallel && (bytesRemaining > 0 || (encoder != NULL && lzPending(encoder) > 0))) {
+        // Follow the link layer's advice, smaller packets on a noisy cable
+        double errorRate;
+        int recommended = llrecommendedpayload(&errorRate);
+        if (recommended != payloadSize) {
+            printf("Packet size %d -> %d bytes (frame error rate %.4f)\n", payloadSize, recommended, errorRate);
+            payloadSize = recommended;
+        }
+        unsigned int maxDataSize = payloadSize - 3;
+        if (maxDataSize > 0xFFFF) maxDataSize = 0xFFFF; // Two byte length field
 
-        if (read(fd, dataPacket + 3, chunkSize) < chunkSize) {
-            perror("Error reading from file");
-            break;
+        unsigned int chunkSize;
+        if (encoder != NULL) {
+            // As much of the file as fits in the packet once compressed, or a packet
+            // of it as is when it would not compress
+            if (fillCompressor(encoder, fd, fileSize, &bytesRemaining) < 0) {
+                perror("Error reading from file");
+                break;
+            }
+            chunkSize = compressPacket(encoder, dataPacket, maxDataSize);
+            if (dataPacket[0] & C_STORED) numStored++;
+        } else {
+            // The header and a slice of the file go to the frame encoder as they are
+            const unsigned char *data;
+            int size = nextFileSlice(&source, maxDataSize, &data);
+            if (size <= 0) {
+                perror("Error reading from file");
+                break;
+            }
+            chunkSize = size;
+            bytesRemaining -= chunkSize;
+            dataPacket[0] = C_DATA;
+            dataPacket[1] = (chunkSize >> 8) & 0xFF;
+            dataPacket[2] = chunkSize & 0xFF;
+            pieces[1].iov_base = (void *) data;
+            pieces[1].iov_len = chunkSize;
         }
 
-        if (llwrite(dataPacket, chunkSize + 3) != (int)(chunkSize + 3)) {
+        int written = (encoder != NULL) ? llwrite(dataPacket, chunkSize + 3) : llwritev(pieces, 2);
+        if (written != (int)(chunkSize + 3)) {
             perror("Error sending data packet");
             break;
         }
 
         printf("Sent data packet of size %u bytes\n", chunkSize);
-        bytesRemaining -= chunkSize;
+        bytesSent += chunkSize;
+        numPackets++;
     }
 
     free(dataPacket);
+    if (COMPRESSION == LzNone) closeFileSource(&source);
 
     unsigned char* endPacket = constructControlPacket(C_END, fileSize);
     if (llwrite(endPacket, 11) == -1) {
         perror("Error sending END packet");
     }
     free(endPacket);
+
+    // File bytes that made it into data packets
+    unsigned long bytesDone = fileSize - bytesRemaining - (encoder != NULL ? lzPending(encoder) : 0);
+    double seconds = secondsSince(&startTime);
+    printf("Sent %lu of %lu bytes in %.2f s (%.0f bit/s of file data)", bytesDone, fileSize, seconds, bytesDone * 8 / seconds);
+    if (COMPRESSION != LzNone)
+        printf(", compressed to %lu bytes (ratio %.3f, %d of %d packets stored)", bytesSent,
+               bytesDone ? (double)bytesSent / bytesDone : 1.0, numStored, numPackets);
+    printf("\n");
+    lzEncoderFree(encoder);
 }
 
 // Receiver: receives data packets and saves them to a file
 int receiveFileData(int fd) {
-    unsigned char* buffer = (unsigned char*) calloc(MAX_PAYLOAD_SIZE, sizeof(unsigned char));
+    unsigned char* buffer = (unsigned char*) calloc(llmaxpayload(), sizeof(unsigned char));
 
     // Receive and parse START packet
-    if (llread(buffer) == -1 || buffer[0] != C_START) {
+    int size = llread(buffer);
+    if (size == -1 || buffer[0] != C_START) {
         perror("Error receiving START packet");
         free(buffer);
         return -1;
     }
+    struct timespec startTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
 
     unsigned long expectedFileSize = 0;
     for (int i = 3; i < 11; i++) {
         expectedFileSize = (expectedFileSize << 8) | buffer[i];
     }
 
+    // TLVs after the file size
+    LzDecoder *decoder = NULL;
+    for (int i = 11; i + 2 <= size && i + 2 + buffer[i + 1] <= size; i += 2 + buffer[i + 1]) {
+        if (buffer[i] != 2 || buffer[i + 1] != 1 || buffer[i + 2] == LzNone) continue; // Codec TLV only
+        if (buffer[i + 2] > LzDense || (decoder = lzDecoderCreate()) == NULL) {
+            printf("Error: cannot decompress codec %d\n", buffer[i + 2]);
+            free(buffer);
+            return -1;
+        }
+    }
+
+    FileSink sink;
+    if (openFileSink(&sink, fd, expectedFileSize) < 0) {
+        perror("Error preparing the output file");
+        lzDecoderFree(decoder);
+        free(buffer);
+        return -1;
+    }
+
     unsigned long receivedBytes = 0;
+    unsigned long packetBytes = 0;
     while (1) {
         if (llread(buffer) == -1) {
             perror("Error receiving data packet, retrying...");
@@ -100,28 +691,551 @@ int receiveFileData(int fd) {
         if (buffer[0] == C_END) break;
 
         unsigned int packetSize = (buffer[1] << 8) | buffer[2];
-        if (write(fd, buffer + 3, packetSize) != (ssize_t) packetSize) {
+        const unsigned char *data = buffer + 3;
+        int dataSize = packetSize;
+        int compressed = !(buffer[0] & C_STORED);
+        if (decoder != NULL && (dataSize = lzDecompress(decoder, buffer + 3, packetSize, compressed, &data)) < 0) {
+            printf("Error: corrupt compressed data packet\n");
+            break;
+        }
+        if (sinkWrite(&sink, data, dataSize) < 0) {
             perror("Error writing data to file");
             break;
         }
 
-        receivedBytes += packetSize;
-        printf("Received and wrote %u bytes of data\n", packetSize);
+        receivedBytes += dataSize;
+        packetBytes += packetSize;
+        printf("Received and wrote %d bytes of data\n", dataSize);
     }
 
+    int status = closeFileSink(&sink);
+    if (status < 0) perror("Error writing data to file");
+
     // Validate END packet's file size
     unsigned long endFileSize = 0;
     for (int i = 3; i < 11; i++) {
         endFileSize = (endFileSize << 8) | buffer[i];
     }
 
+    double seconds = secondsSince(&startTime);
+    printf("Received %lu bytes in %.2f s (%.0f bit/s of file data)", receivedBytes, seconds, receivedBytes * 8 / seconds);
+    if (decoder != NULL)
+        printf(", compressed to %lu bytes (ratio %.3f)", packetBytes, receivedBytes ? (double)packetBytes / receivedBytes : 1.0);
+    printf("\n");
+
+    lzDecoderFree(decoder);
     free(buffer);
-    return (expectedFileSize == endFileSize) ? 0 : -1;
+    return (status == 0 && expectedFileSize == endFileSize) ? 0 : -1;
+}
+
+////////////////////////////////////////////////
+// FULL DUPLEX TRANSFER
+////////////////////////////////////////////////
+
+// One file goes each way over the same link: each end sends a packet whenever the
+// window has room and reads whatever arrived in between.
+
+typedef struct {
+    int fd;
+    unsigned long fileSize;
+    unsigned long offset;
+    unsigned char next; // C_START, C_DATA or C_END, 0 once END is sent
+} OutgoingFile;
+
+typedef struct {
+    int fd;
+    unsigned long fileSize;
+    unsigned long received;
+    int done;
+} IncomingFile;
+
+// Sends the next packet of the outgoing file. Returns -1 on error.
+int sendNextPacket(OutgoingFile *out, unsigned char *packet) {
+    int size;
+    if (out->next == C_START || out->next == C_END) {
+        unsigned char *controlPacket = constructControlPacket(out->next, out->fileSize);
+        memcpy(packet, controlPacket, 11);
+        free(controlPacket);
+        size = 11;
+        if (out->next == C_END) out->next = 0;
+        else out->next = (out->fileSize > 0) ? C_DATA : C_END;
+    } else {
+        unsigned int maxDataSize = llrecommendedpayload(NULL) - 3;
+        if (maxDataSize > 0xFFFF) maxDataSize = 0xFFFF;
+        unsigned long bytesRemaining = out->fileSize - out->offset;
+        unsigned int chunkSize = (bytesRemaining < maxDataSize) ? bytesRemaining : maxDataSize;
+
+        packet[0] = C_DATA;
+        packet[1] = (chunkSize >> 8) & 0xFF;
+        packet[2] = chunkSize & 0xFF;
+        if (read(out->fd, packet + 3, chunkSize) < chunkSize) {
+            perror("Error reading from file");
+            return -1;
+        }
+        size = chunkSize + 3;
+        out->offset += chunkSize;
+        if (out->offset == out->fileSize) out->next = C_END;
+        printf("Sent data packet of size %u bytes\n", chunkSize);
+    }
+    return llwrite(packet, size) == size ? 0 : -1;
+}
+
+// Reads one packet of the incoming file. Returns -1 on error.
+int receiveNextPacket(IncomingFile *in, unsigned char *packet) {
+    int size = llread(packet);
+    if (size < 0) return 0; // Rejected frame, it is being retransmitted
+    if (size == 0) return -1;
+
+    if (packet[0] == C_START) {
+        for (int i = 3; i < 11; i++) in->fileSize = (in->fileSize << 8) | packet[i];
+    } else if (packet[0] == C_DATA) {
+        unsigned int packetSize = (packet[1] << 8) | packet[2];
+        if (write(in->fd, packet + 3, packetSize) != (ssize_t) packetSize) {
+            perror("Error writing data to file");
+            return -1;
+        }
+        in->received += packetSize;
+        printf("Received and wrote %u bytes of data\n", packetSize);
+    } else if (packet[0] == C_END) {
+        in->done = TRUE;
+    }
+    return 0;
+}
+
+void duplexTransfer(LinkLayerRole role, const char *filename) {
+    char receivedName[256];
+    snprintf(receivedName, sizeof(receivedName), "%s.received", DUPLEX_FILE);
+    const char *sendName = (role == LlTx) ? filename : DUPLEX_FILE;
+    const char *receiveName = (role == LlTx) ? receivedName : filename;
+
+    OutgoingFile out = {.next = C_START};
+    IncomingFile in = {0};
+    struct stat fileStats;
+    out.fd = open(sendName, O_RDONLY);
+    if (out.fd == -1 || fstat(out.fd, &fileStats) == -1) {
+        perror("Error opening file for transmission");
+        return;
+    }
+    out.fileSize = fileStats.st_size;
+    in.fd = open(receiveName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (in.fd == -1) {
+        perror("Error opening file for reception");
+        close(out.fd);
+        return;
+    }
+
+    printf("Starting full duplex transfer: sending %s, receiving %s...\n", sendName, receiveName);
+    unsigned char *sendPacket = (unsigned char *) malloc(llmaxpayload());
+    unsigned char *receivePacket = (unsigned char *) malloc(llmaxpayload());
+    int failed = FALSE;
+
+    while (!failed && (out.next != 0 || !in.done)) {
+        if (out.next != 0 && sendNextPacket(&out, sendPacket) < 0) failed = TRUE;
+
+        // Take what arrived meanwhile, and once our file is out wait for the rest
+        while (!failed && !in.done) {
+            int pending = (out.next == 0) ? TRUE : llpending();
+            if (pending < 0) failed = TRUE;
+            if (pending <= 0) break;
+            if (receiveNextPacket(&in, receivePacket) < 0) failed = TRUE;
+        }
+    }
+
+    free(sendPacket);
+    free(receivePacket);
+    close(out.fd);
+    close(in.fd);
+
+    if (failed || in.received != in.fileSize) {
+        printf("Full duplex transfer failed (%lu of %lu bytes received).\n", in.received, in.fileSize);
+        return;
+    }
+    printf("Sent %lu bytes and received %lu bytes.\n", out.fileSize, in.received);
+}
+
+////////////////////////////////////////////////
+// BONDED TRANSFER
+////////////////////////////////////////////////
+
+// The file is cut in chunks of chunkSize bytes, each sent as a C_CHUNK packet with its
+// offset on whichever link is free. When a link dies, the chunks it may not have
+// delivered are handed to the others; a chunk received twice is just written twice.
+
+typedef struct {
+    unsigned long offset;
+    unsigned int size;
+} Chunk;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int fd;
+    unsigned long fileSize;
+    unsigned int chunkSize;
+
+    // Transmitter
+    unsigned long nextOffset; // Chunks from here on were not handed out yet
+    Chunk requeued[MAX_BONDED_LINKS * MAX_WINDOW_SIZE];
+    int numRequeued;
+    int busy;  // Links sending or waiting for acknowledgements
+    int alive;
+    int aborted; // The file could not be read, no more chunks are handed out
+
+    // Receiver
+    unsigned char *received; // One flag per chunk
+    unsigned long numChunks;
+    unsigned long numReceived;
+    int endSeen;
+} BondedTransfer;
+
+typedef struct {
+    BondedTransfer *transfer;
+    LinkLayer params;
+    LinkConnection *connection;
+    pthread_t thread;
+    Chunk outstanding[MAX_WINDOW_SIZE]; // Last chunks written, maybe not acknowledged yet
+    int numOutstanding;
+    int ended;    // Receiver: END packet received
+    int finished; // Receiver: link closed
+} BondedLink;
+
+// Next chunk to send, a requeued one first. Called with the lock held.
+int takeChunk(BondedTransfer *t, Chunk *chunk) {
+    if (t->aborted) return FALSE;
+    if (t->numRequeued > 0) {
+        *chunk = t->requeued[--t->numRequeued];
+        return TRUE;
+    }
+    if (t->nextOffset >= t->fileSize) return FALSE;
+    chunk->offset = t->nextOffset;
+    chunk->size = (t->fileSize - t->nextOffset < t->chunkSize) ? t->fileSize - t->nextOffset : t->chunkSize;
+    t->nextOffset += chunk->size;
+    return TRUE;
+}
+
+// Gives the chunks of a dead link to the surviving ones
+void linkFailed(BondedLink *link) {
+    BondedTransfer *t = link->transfer;
+    pthread_mutex_lock(&t->lock);
+    for (int i = 0; i < link->numOutstanding; i++) t->requeued[t->numRequeued++] = link->outstanding[i];
+    t->busy--;
+    t->alive--;
+    pthread_cond_broadcast(&t->changed);
+    pthread_mutex_unlock(&t->lock);
+
+    printf("Link %s failed, %d chunks handed to the other links\n", link->params.serialPort, link->numOutstanding);
+    llconnclose(link->connection, FALSE);
+    link->connection = NULL;
+}
+
+void *openBondedLink(void *arg) {
+    BondedLink *link = (BondedLink *) arg;
+    link->connection = llconnopen(link->params);
+    return NULL;
+}
+
+void *transmitBondedLink(void *arg) {
+    BondedLink *link = (BondedLink *) arg;
+    BondedTransfer *t = link->transfer;
+    LinkConnection *c = link->connection;
+
+    unsigned char startPacket[17];
+    unsigned char *controlPacket = constructControlPacket(C_START, t->fileSize);
+    memcpy(startPacket, controlPacket, 11);
+    free(controlPacket);
+    startPacket[11] = 1; // Chunk size TLV type
+    startPacket[12] = 4;
+    for (int i = 0; i < 4; i++) startPacket[13 + i] = (t->chunkSize >> (24 - 8 * i)) & 0xFF;
+
+    unsigned char *packet = (unsigned char *) malloc(CHUNK_HEADER_SIZE + t->chunkSize);
+    if (llconnwrite(c, startPacket, sizeof(startPacket)) < 0) {
+        free(packet);
+        linkFailed(link);
+        return NULL;
+    }
+
+    while (TRUE) {
+        Chunk chunk;
+        pthread_mutex_lock(&t->lock);
+        int found = takeChunk(t, &chunk);
+        pthread_mutex_unlock(&t->lock);
+
+        if (!found) {
+            // Out of work: make sure everything sent arrived, then wait for chunks
+            // requeued by a failing link or for every link to be done
+            if (llconnflush(c) < 0) {
+                free(packet);
+                linkFailed(link);
+                return NULL;
+            }
+            link->numOutstanding = 0;
+
+            pthread_mutex_lock(&t->lock);
+            t->busy--;
+            pthread_cond_broadcast(&t->changed);
+            while (t->numRequeued == 0 && t->busy > 0 && !t->aborted) pthread_cond_wait(&t->changed, &t->lock);
+            found = takeChunk(t, &chunk);
+            if (found) t->busy++;
+            pthread_mutex_unlock(&t->lock);
+            if (!found) break;
+        }
+
+        if (link->numOutstanding == MAX_WINDOW_SIZE) {
+            memmove(link->outstanding, link->outstanding + 1, (MAX_WINDOW_SIZE - 1) * sizeof(Chunk));
+            link->numOutstanding--;
+        }
+        link->outstanding[link->numOutstanding++] = chunk;
+
+        packet[0] = C_CHUNK;
+        packet[1] = (chunk.size >> 8) & 0xFF;
+        packet[2] = chunk.size & 0xFF;
+        for (int i = 0; i < 8; i++) packet[3 + i] = (chunk.offset >> (56 - 8 * i)) & 0xFF;
+
+        if (pread(t->fd, packet + CHUNK_HEADER_SIZE, chunk.size, chunk.offset) < (ssize_t) chunk.size) {
+            // Another link would fail the same way: every link ends the transfer
+            perror("Error reading from file");
+            pthread_mutex_lock(&t->lock);
+            t->aborted = TRUE;
+            t->busy--;
+            pthread_cond_broadcast(&t->changed);
+            pthread_mutex_unlock(&t->lock);
+            break;
+        }
+        if (llconnwrite(c, packet, CHUNK_HEADER_SIZE + chunk.size) < 0) {
+            free(packet);
+            linkFailed(link);
+            return NULL;
+        }
+        printf("%s: sent %u bytes at offset %lu\n", link->params.serialPort, chunk.size, chunk.offset);
+    }
+    free(packet);
+
+    unsigned char *endPacket = constructControlPacket(C_END, t->fileSize);
+    if (llconnwrite(c, endPacket, 11) == -1) {
+        perror("Error sending END packet");
+    }
+    free(endPacket);
+
+    if (llconnclose(c, TRUE) == -1) {
+        perror("Error closing link layer connection");
+    }
+    link->connection = NULL;
+    return NULL;
+}
+
+void *receiveBondedLink(void *arg) {
+    BondedLink *link = (BondedLink *) arg;
+    BondedTransfer *t = link->transfer;
+
+    LinkConnection *c = llconnopen(link->params);
+    if (c != NULL) {
+        unsigned char *buffer = (unsigned char *) malloc(llconnmaxpayload(c));
+        int size;
+        while ((size = llconnread(c, buffer)) != 0) {
+            if (size < 0) continue; // Rejected frame, it is being retransmitted
+
+            if (buffer[0] == C_START && size >= 17) {
+                unsigned long fileSize = 0;
+                unsigned int chunkSize = 0;
+                for (int i = 3; i < 11; i++) fileSize = (fileSize << 8) | buffer[i];
+                for (int i = 13; i < 17; i++) chunkSize = (chunkSize << 8) | buffer[i];
+                if (chunkSize == 0) {
+                    printf("%s: START packet with no chunk size ignored\n", link->params.serialPort);
+                    continue;
+                }
+
+                pthread_mutex_lock(&t->lock);
+                if (t->received == NULL) {
+                    t->fileSize = fileSize;
+                    t->chunkSize = chunkSize;
+                    t->numChunks = (t->fileSize + t->chunkSize - 1) / t->chunkSize;
+                    t->received = (unsigned char *) calloc(t->numChunks + 1, 1);
+                    if (ftruncate(t->fd, t->fileSize) == -1) perror("Error sizing received file");
+                }
+                pthread_mutex_unlock(&t->lock);
+
+            } else if (buffer[0] == C_CHUNK && size >= CHUNK_HEADER_SIZE) {
+                unsigned int chunkSize = (buffer[1] << 8) | buffer[2];
+                unsigned long offset = 0;
+                for (int i = 3; i < 11; i++) offset = (offset << 8) | buffer[i];
+
+                // The header must describe data the packet holds, inside the announced file
+                pthread_mutex_lock(&t->lock);
+                int valid = t->received != NULL && chunkSize <= (unsigned int)(size - CHUNK_HEADER_SIZE) &&
+                            chunkSize <= t->chunkSize && offset <= t->fileSize && chunkSize <= t->fileSize - offset;
+                pthread_mutex_unlock(&t->lock);
+                if (!valid) {
+                    printf("%s: invalid chunk of %u bytes at offset %lu ignored\n", link->params.serialPort, chunkSize, offset);
+                    continue;
+                }
+                if (pwrite(t->fd, buffer + CHUNK_HEADER_SIZE, chunkSize, offset) != (ssize_t) chunkSize) {
+                    perror("Error writing data to file");
+                    continue;
+                }
+
+                pthread_mutex_lock(&t->lock);
+                unsigned long index = offset / t->chunkSize;
+                if (index < t->numChunks && !t->received[index]) {
+                    t->received[index] = TRUE;
+                    t->numReceived++;
+                }
+                pthread_cond_broadcast(&t->changed);
+                pthread_mutex_unlock(&t->lock);
+                printf("%s: received %u bytes at offset %lu\n", link->params.serialPort, chunkSize, offset);
+
+            } else if (buffer[0] == C_END) {
+                pthread_mutex_lock(&t->lock);
+                link->ended = TRUE;
+                t->endSeen = TRUE;
+                pthread_cond_broadcast(&t->changed);
+                pthread_mutex_unlock(&t->lock);
+                break; // llconnclose answers the DISC that follows
+            }
+        }
+        free(buffer);
+
+        if (llconnclose(c, TRUE) == -1) {
+            perror("Error closing link layer connection");
+        }
+    }
+
+    pthread_mutex_lock(&t->lock);
+    link->finished = TRUE;
+    pthread_cond_broadcast(&t->changed);
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+int bondedFileComplete(BondedTransfer *t) {
+    return t->endSeen && t->received != NULL && t->numReceived == t->numChunks;
+}
+
+// TRUE once every link is closed, or once the file is complete and the links that
+// received END are closed (a link that died never gets its END nor DISC)
+int bondedReceptionOver(BondedTransfer *t, BondedLink *links, int numLinks, int lingerOver) {
+    for (int i = 0; i < numLinks; i++) {
+        if (links[i].finished) continue;
+        if (!bondedFileComplete(t) || links[i].ended || !lingerOver) return FALSE;
+    }
+    return TRUE;
+}
+
+void bondedTransfer(const char *serialPorts, LinkLayerRole role, int baudRate, int nTries, int timeout, const char *filename) {
+    // Static: a receiving thread left behind on a dead link may still refer to them
+    static BondedLink links[MAX_BONDED_LINKS];
+    static BondedTransfer transfer;
+    memset(links, 0, sizeof(links));
+    memset(&transfer, 0, sizeof(transfer));
+    pthread_mutex_init(&transfer.lock, NULL);
+    pthread_cond_init(&transfer.changed, NULL);
+
+    int numLinks = 0;
+    char ports[MAX_BONDED_LINKS * 50];
+    strncpy(ports, serialPorts, sizeof(ports) - 1);
+    ports[sizeof(ports) - 1] = '\0';
+    for (char *port = strtok(ports, ","); port != NULL && numLinks < MAX_BONDED_LINKS; port = strtok(NULL, ",")) {
+        links[numLinks].transfer = &transfer;
+        links[numLinks].params = initializeLinkLayer(port, role, baudRate, nTries, timeout);
+        numLinks++;
+    }
+
+    if (role == LlTx) {
+        transfer.fd = open(filename, O_RDONLY);
+        struct stat fileStats;
+        if (transfer.fd == -1 || fstat(transfer.fd, &fileStats) == -1) {
+            perror("Error opening file for transmission");
+            return;
+        }
+        transfer.fileSize = fileStats.st_size;
+
+        // Links that fail to connect are left out, the chunks must fit the smallest payload
+        for (int i = 0; i < numLinks; i++) pthread_create(&links[i].thread, NULL, openBondedLink, &links[i]);
+        transfer.chunkSize = 0xFFFF;
+        for (int i = 0; i < numLinks; i++) {
+            pthread_join(links[i].thread, NULL);
+            if (links[i].connection == NULL) {
+                printf("Link %s could not be opened\n", links[i].params.serialPort);
+                continue;
+            }
+            transfer.alive++;
+            int chunkSize = llconnmaxpayload(links[i].connection) - CHUNK_HEADER_SIZE;
+            if (chunkSize < (int) transfer.chunkSize) transfer.chunkSize = chunkSize;
+        }
+        if (transfer.alive == 0) {
+            perror("Failed to open link layer connection");
+            close(transfer.fd);
+            return;
+        }
+
+        printf("Starting bonded file transmission over %d links, %u byte chunks...\n", transfer.alive, transfer.chunkSize);
+        transfer.busy = transfer.alive;
+        for (int i = 0; i < numLinks; i++) {
+            if (links[i].connection != NULL) pthread_create(&links[i].thread, NULL, transmitBondedLink, &links[i]);
+        }
+        for (int i = 0; i < numLinks; i++) {
+            if (links[i].connection != NULL) pthread_join(links[i].thread, NULL);
+        }
+        close(transfer.fd);
+
+        if (transfer.alive == 0) {
+            printf("All links failed, transmission incomplete.\n");
+            return;
+        }
+        if (transfer.aborted) {
+            printf("File could not be read, transmission incomplete.\n");
+            return;
+        }
+
+    } else {
+        transfer.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (transfer.fd == -1) {
+            perror("Error opening file for reception");
+            return;
+        }
+
+        printf("Starting bonded file reception over %d links...\n", numLinks);
+        for (int i = 0; i < numLinks; i++) pthread_create(&links[i].thread, NULL, receiveBondedLink, &links[i]);
+
+        // Once the file is complete, links without END get the frame timeout to catch up
+        pthread_mutex_lock(&transfer.lock);
+        struct timespec deadline = {0, 0};
+        int lingerOver = FALSE;
+        while (!bondedReceptionOver(&transfer, links, numLinks, lingerOver)) {
+            if (deadline.tv_sec == 0 && bondedFileComplete(&transfer)) deadline.tv_sec = time(NULL) + timeout;
+            if (deadline.tv_sec == 0) {
+                pthread_cond_wait(&transfer.changed, &transfer.lock);
+            } else if (pthread_cond_timedwait(&transfer.changed, &transfer.lock, &deadline) == ETIMEDOUT) {
+                lingerOver = TRUE;
+            }
+        }
+        int complete = transfer.received != NULL && transfer.numReceived == transfer.numChunks;
+        pthread_mutex_unlock(&transfer.lock);
+
+        for (int i = 0; i < numLinks; i++) {
+            if (links[i].finished) pthread_join(links[i].thread, NULL);
+            else printf("Link %s gave no END, left behind\n", links[i].params.serialPort);
+        }
+        close(transfer.fd);
+
+        if (!complete) {
+            printf("File reception failed, %lu of %lu chunks received.\n", transfer.numReceived, transfer.numChunks);
+            return;
+        }
+    }
+
+    printf("Transmission completed successfully.\n");
 }
 
 // Main application layer function to handle transmitter and receiver roles
 void applicationLayer(const char *serialPort, const char *role, int baudRate, int nTries, int timeout, const char *filename) {
     LinkLayerRole appRole = (strcmp(role, "tx") == 0) ? LlTx : LlRx;
+
+    // Several ports ("/dev/ttyS10,/dev/ttyS12") stripe the file over all of them
+    if (strchr(serialPort, ',') != NULL) {
+        bondedTransfer(serialPort, appRole, baudRate, nTries, timeout, filename);
+        return;
+    }
+
     LinkLayer connectionParams = initializeLinkLayer(serialPort, appRole, baudRate, nTries, timeout);
 
     if (llopen(connectionParams) == -1) {
@@ -129,7 +1243,9 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate, in
         return;
     }
 
-    if (appRole == LlTx) {
+    if (connectionParams.fullDuplex) {
+        duplexTransfer(appRole, filename);
+    } else if (appRole == LlTx) {
         int fd = open(filename, O_RDONLY);
         if (fd == -1) {
             perror("Error opening file for transmission");
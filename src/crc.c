@@ -0,0 +1,104 @@
+// Table driven CRC implementation (slice-by-8, SSE4.2 crc32 instruction when available)
+
+#include "crc.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC16_POLY 0x8408     // 0x1021 reflected
+#define CRC32_POLY 0x82F63B78 // 0x1EDC6F41 reflected
+
+static uint16_t crc16Table[8][256];
+static uint32_t crc32Table[8][256];
+static pthread_once_t initialized = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32Software(uint32_t crc, const unsigned char *data, size_t size);
+static uint32_t (*crc32Impl)(uint32_t, const unsigned char *, size_t) = crc32Software;
+
+// Slice-by-8: table k holds the CRC of a byte followed by k zero bytes,
+// so eight input bytes are folded with eight independent lookups.
+uint16_t crc16Update(uint16_t crc, const unsigned char *data, size_t size) {
+    while (size >= 8) {
+        crc = crc16Table[7][data[0] ^ (crc & 0xFF)] ^ crc16Table[6][data[1] ^ (crc >> 8)] ^
+              crc16Table[5][data[2]] ^ crc16Table[4][data[3]] ^
+              crc16Table[3][data[4]] ^ crc16Table[2][data[5]] ^
+              crc16Table[1][data[6]] ^ crc16Table[0][data[7]];
+        data += 8;
+        size -= 8;
+    }
+    while (size--) {
+        crc = (crc >> 8) ^ crc16Table[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+static uint32_t crc32Software(uint32_t crc, const unsigned char *data, size_t size) {
+    while (size >= 8) {
+        uint32_t low = crc ^ (data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24));
+        crc = crc32Table[7][low & 0xFF] ^ crc32Table[6][(low >> 8) & 0xFF] ^
+              crc32Table[5][(low >> 16) & 0xFF] ^ crc32Table[4][low >> 24] ^
+              crc32Table[3][data[4]] ^ crc32Table[2][data[5]] ^
+              crc32Table[1][data[6]] ^ crc32Table[0][data[7]];
+        data += 8;
+        size -= 8;
+    }
+    while (size--) {
+        crc = (crc >> 8) ^ crc32Table[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// The SSE4.2 crc32 instruction implements exactly the Castagnoli polynomial
+__attribute__((target("sse4.2")))
+static uint32_t crc32Hardware(uint32_t crc, const unsigned char *data, size_t size) {
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (size--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+uint32_t crc32Update(uint32_t crc, const unsigned char *data, size_t size) {
+    return crc32Impl(crc, data, size);
+}
+
+static void buildTables() {
+    for (int i = 0; i < 256; i++) {
+        uint16_t c16 = i;
+        uint32_t c32 = i;
+        for (int bit = 0; bit < 8; bit++) {
+            c16 = (c16 & 1) ? (c16 >> 1) ^ CRC16_POLY : c16 >> 1;
+            c32 = (c32 & 1) ? (c32 >> 1) ^ CRC32_POLY : c32 >> 1;
+        }
+        crc16Table[0][i] = c16;
+        crc32Table[0][i] = c32;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            crc16Table[k][i] = (crc16Table[k - 1][i] >> 8) ^ crc16Table[0][crc16Table[k - 1][i] & 0xFF];
+            crc32Table[k][i] = (crc32Table[k - 1][i] >> 8) ^ crc32Table[0][crc32Table[k - 1][i] & 0xFF];
+        }
+    }
+
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) crc32Impl = crc32Hardware;
+#endif
+}
+
+void crcInit() {
+    pthread_once(&initialized, buildTables);
+}
@@ -0,0 +1,330 @@
+// Frame encoding: FCS, byte stuffing and COBS
+
+#include "framing.h"
+#include "crc.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Bytes checksummed and stuffed together, small enough to stay in L1 between both steps
+#define ENCODE_BLOCK 256
+
+static uint32_t residues[LlFcsCrc32 + 1];
+
+static int findFlagOrEscScalar(const unsigned char *data, int size);
+static int (*findFlagOrEscImpl)(const unsigned char *, int) = findFlagOrEscScalar;
+
+int fcsLength(LinkLayerFcs type) {
+    switch (type) {
+        case LlFcsCrc16: return 2;
+        case LlFcsCrc32: return 4;
+        default: return 1;
+    }
+}
+
+uint32_t fcsStart(LinkLayerFcs type) {
+    switch (type) {
+        case LlFcsCrc16: return CRC16_INIT;
+        case LlFcsCrc32: return CRC32_INIT;
+        default: return 0;
+    }
+}
+
+uint32_t fcsUpdate(LinkLayerFcs type, uint32_t acc, const unsigned char *data, int size) {
+    switch (type) {
+        case LlFcsCrc16: return crc16Update((uint16_t)acc, data, size);
+        case LlFcsCrc32: return crc32Update(acc, data, size);
+        default: {
+            // XOR eight bytes at a time and fold the word at the end
+            uint64_t word = 0;
+            int i = 0;
+            for (; i + 8 <= size; i += 8) {
+                uint64_t next;
+                memcpy(&next, data + i, 8);
+                word ^= next;
+            }
+            word ^= word >> 32;
+            word ^= word >> 16;
+            word ^= word >> 8;
+            acc ^= word & 0xFF;
+            for (; i < size; i++) acc ^= data[i];
+            return acc;
+        }
+    }
+}
+
+// Writes the FCS for the running value acc, least significant byte first
+void fcsAppend(LinkLayerFcs type, uint32_t acc, unsigned char *out) {
+    if (type == LlFcsBcc2) {
+        out[0] = (unsigned char)acc;
+        return;
+    }
+    acc = ~acc;
+    for (int i = 0; i < fcsLength(type); i++) {
+        out[i] = (acc >> (8 * i)) & 0xFF;
+    }
+}
+
+uint32_t fcsResidue(LinkLayerFcs type) {
+    return residues[type];
+}
+
+static int findFlagOrEscScalar(const unsigned char *data, int size) {
+    int i = 0;
+    while (i < size && data[i] != FLAG && data[i] != ESC) i++;
+    return i;
+}
+
+#if defined(__x86_64__)
+// SSE2 is part of x86-64, so this one needs no runtime check
+static int findFlagOrEscSse2(const unsigned char *data, int size) {
+    const __m128i flag = _mm_set1_epi8(FLAG);
+    const __m128i esc = _mm_set1_epi8(ESC);
+    int i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, flag), _mm_cmpeq_epi8(block, esc)));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return i + findFlagOrEscScalar(data + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static int findFlagOrEscAvx2(const unsigned char *data, int size) {
+    const __m256i flag = _mm256_set1_epi8(FLAG);
+    const __m256i esc = _mm256_set1_epi8(ESC);
+    int i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(block, flag), _mm256_cmpeq_epi8(block, esc)));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return i + findFlagOrEscSse2(data + i, size - i);
+}
+#endif
+
+int findFlagOrEsc(const unsigned char *data, int size) {
+    return findFlagOrEscImpl(data, size);
+}
+
+// Running the FCS over a frame followed by its own FCS always gives the same residue,
+// so the receiver can check the frame without knowing in advance where the data ends.
+static void buildTables() {
+    crcInit();
+    rsInit();
+    for (LinkLayerFcs type = LlFcsBcc2; type <= LlFcsCrc32; type++) {
+        unsigned char check[MAX_FCS_SIZE];
+        fcsAppend(type, fcsStart(type), check);
+        residues[type] = fcsUpdate(type, fcsStart(type), check, fcsLength(type));
+    }
+
+#if defined(__x86_64__)
+    findFlagOrEscImpl = __builtin_cpu_supports("avx2") ? findFlagOrEscAvx2 : findFlagOrEscSse2;
+#endif
+}
+
+void framingInit() {
+    static pthread_once_t initialized = PTHREAD_ONCE_INIT;
+    pthread_once(&initialized, buildTables);
+}
+
+unsigned char *stuffBytes(unsigned char *out, const unsigned char *data, int size) {
+    while (size > 0) {
+        int run = findFlagOrEsc(data, size);
+        memcpy(out, data, run);
+        out += run;
+        if (run == size) break;
+
+        *out++ = ESC;
+        *out++ = data[run] ^ 0x20;
+        data += run + 1;
+        size -= run + 1;
+    }
+    return out;
+}
+
+unsigned char *cobsBegin(CobsEncoder *e, unsigned char *out) {
+    e->code = out;
+    e->length = 1;
+    return out + 1;
+}
+
+unsigned char *cobsBytes(CobsEncoder *e, unsigned char *out, const unsigned char *data, int size) {
+    while (size > 0) {
+        if (*data == FLAG) {
+            // Back to back FLAGs are not worth a memchr() call each
+            *e->code = e->length ^ FLAG;
+            out = cobsBegin(e, out);
+            data++;
+            size--;
+            continue;
+        }
+        int room = 255 - e->length;
+        int n = (size < room) ? size : room;
+        const unsigned char *flag = memchr(data, FLAG, n);
+        int run = flag ? flag - data : n;
+        memcpy(out, data, run);
+        out += run;
+        data += run;
+        size -= run;
+        e->length += run;
+
+        if (flag) {
+            // The FLAG itself is implied by closing the block
+            data++;
+            size--;
+        } else if (e->length < 255) {
+            break;
+        }
+        *e->code = e->length ^ FLAG;
+        out = cobsBegin(e, out);
+    }
+    return out;
+}
+
+void cobsEnd(CobsEncoder *e) {
+    *e->code = e->length ^ FLAG;
+}
+
+int cobsDecode(CobsDecoder *d, unsigned char *out, const unsigned char *data, int size) {
+    unsigned char *start = out;
+    while (size > 0) {
+        if (d->left == 0) {
+            int code = *data++ ^ FLAG;
+            size--;
+            if (d->flagPending) *out++ = FLAG;
+            d->left = code - 1;
+            d->flagPending = code < 255;
+            continue;
+        }
+        int n = (d->left < size) ? d->left : size;
+        memmove(out, data, n);
+        out += n;
+        data += n;
+        size -= n;
+        d->left -= n;
+    }
+    return out - start;
+}
+
+// Stuffs or COBS encodes the next bytes of an information field
+static unsigned char *encodeBytes(CobsEncoder *cobs, unsigned char *out, const unsigned char *data, int size) {
+    return cobs ? cobsBytes(cobs, out, data, size) : stuffBytes(out, data, size);
+}
+
+int encodeFrame(unsigned char *out, unsigned char addr, unsigned char ctrl,
+                const unsigned char *data, int size, LinkLayerFcs fcs, LinkLayerFraming framing) {
+    struct iovec piece = {(void *) data, size};
+    return encodeFrameV(out, addr, ctrl, &piece, 1, fcs, framing);
+}
+
+int encodeFrameV(unsigned char *out, unsigned char addr, unsigned char ctrl,
+                 const struct iovec *pieces, int count, LinkLayerFcs fcs, LinkLayerFraming framing) {
+    unsigned char *end = out;
+    *end++ = FLAG;
+    *end++ = addr;
+    *end++ = ctrl;
+    *end++ = addr ^ ctrl;
+
+    CobsEncoder encoder;
+    CobsEncoder *cobs = NULL;
+    if (framing == LlCobs) {
+        cobs = &encoder;
+        end = cobsBegin(cobs, end);
+    }
+
+    uint32_t acc = fcsStart(fcs);
+    for (int p = 0; p < count; p++) {
+        const unsigned char *data = (const unsigned char *) pieces[p].iov_base;
+        int size = pieces[p].iov_len;
+        for (int i = 0; i < size; i += ENCODE_BLOCK) {
+            int block = (size - i < ENCODE_BLOCK) ? size - i : ENCODE_BLOCK;
+            acc = fcsUpdate(fcs, acc, data + i, block);
+            end = encodeBytes(cobs, end, data + i, block);
+        }
+    }
+
+    unsigned char check[MAX_FCS_SIZE];
+    fcsAppend(fcs, acc, check);
+    end = encodeBytes(cobs, end, check, fcsLength(fcs));
+    if (cobs) cobsEnd(cobs);
+    *end++ = FLAG;
+    return end - out;
+}
+
+int encodeFecFrame(unsigned char *out, unsigned char addr, unsigned char ctrl,
+                   const unsigned char *data, int size, LinkLayerFcs fcs, int parity,
+                   LinkLayerFraming framing) {
+    unsigned char *end = out;
+    *end++ = FLAG;
+    *end++ = addr;
+    *end++ = ctrl;
+    *end++ = addr ^ ctrl;
+
+    CobsEncoder encoder;
+    CobsEncoder *cobs = NULL;
+    if (framing == LlCobs) {
+        cobs = &encoder;
+        end = cobsBegin(cobs, end);
+    }
+
+    // The FCS goes through the code as well, so it is needed before the last block
+    unsigned char check[MAX_FCS_SIZE];
+    fcsAppend(fcs, fcsUpdate(fcs, fcsStart(fcs), data, size), check);
+    int checkSize = fcsLength(fcs);
+    int total = size + checkSize;
+
+    unsigned char block[RS_BLOCK_SIZE];
+    int blockData = RS_BLOCK_SIZE - parity;
+    for (int i = 0; i < total; i += blockData) {
+        int n = (total - i < blockData) ? total - i : blockData;
+        const unsigned char *src = data + i;
+        if (i + n > size) {
+            // Block reaching into the FCS
+            int fromData = (i < size) ? size - i : 0;
+            memcpy(block, data + i, fromData);
+            memcpy(block + fromData, check + (i + fromData - size), n - fromData);
+            src = block;
+        }
+        rsEncode(src, n, block + n, parity);
+        end = encodeBytes(cobs, end, src, n);
+        end = encodeBytes(cobs, end, block + n, parity);
+    }
+    if (cobs) cobsEnd(cobs);
+    *end++ = FLAG;
+    return end - out;
+}
+
+int decodeFecField(unsigned char *field, int size, int parity, int *corrected) {
+    int in = 0, out = 0;
+    while (in < size) {
+        int n = (size - in < RS_BLOCK_SIZE) ? size - in : RS_BLOCK_SIZE;
+        if (n <= parity) return -1;
+        int fixed = rsDecode(field + in, n, parity);
+        if (fixed < 0) return -1;
+        *corrected += fixed;
+        memmove(field + out, field + in, n - parity);
+        in += n;
+        out += n - parity;
+    }
+    return out;
+}
+
+int checkInfoField(unsigned char *field, int size, uint32_t acc, LinkLayerFcs fcs, int parity,
+                   int maxPayload, int *corrected) {
+    if (parity > 0) {
+        // Correct the field first, the FCS then checks the corrected bytes
+        size = decodeFecField(field, size, parity, corrected);
+        if (size < 0) return -1;
+        acc = fcsUpdate(fcs, fcsStart(fcs), field, size);
+    }
+    int n = fcsLength(fcs);
+    if (size < n || acc != fcsResidue(fcs)) return -1;
+    // A correct frame can still hold more than the peer agreed to send
+    if (size - n > maxPayload) return -1;
+    return size - n;
+}
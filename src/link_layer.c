@@ -2,15 +2,22 @@
 
 #include "link_layer.h"
 #include "serial_port.h"
+#include "framing.h"
+#include "timer.h"
+
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
 
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
 #define BUF_SIZE 5
+#define RX_RING_SIZE 4096
+#define RTT_HISTORY_SIZE 4096
 #define FALSE 0
 #define TRUE 1
 
-// Frame Control Constants
-#define FLAG 0x7E                     // Flag byte
+// Frame Control Constants (FLAG and ESC are in framing.h)
 #define ADDR_TX 0x03 // Address field for transmitter to receiver
 #define ADDR_RX 0x01 // Address field for receiver to transmitter
 
@@ -25,567 +32,1619 @@
 #define CTRL_I_0 0x00      // Control field for I-frame with sequence number 0
 #define CTRL_I_1 0x40      // Control field for I-frame with sequence number 1
 
-// Byte stuffing
-#define ESC 0x7d
+// Sequence numbers are modulo 2 for stop-and-wait and modulo 8 with a sliding window.
+// Bit 0 of the number sits where the constants above put it, bits 1-2 use spare control bits.
+#define CTRL_I(n) ((((n) & 1) << 6) | (((n) & 6) << 2))
+#define CTRL_RR(n) (CTRL_RR0 | ((n) & 1) | (((n) & 2) << 1) | (((n) & 4) << 2))
+#define CTRL_REJ(n) (CTRL_REJ0 | ((n) & 3) | (((n) & 4) << 1))
+#define CTRL_SREJ(n) (0x81 | (((n) & 7) << 1))   // Selective reject, Selective Repeat only
+#define CTRL_PARITY 0x0F   // XOR of the last I-frames, see PARITY GROUPS
+
+// With full duplex both ends send I-frames and the control field follows the HDLC
+// layout, where I-frames also acknowledge the peer's frames with N(R):
+//   I-frame: N(R) in bits 7-5, 0, N(S) in bits 3-1, 0
+//   S-frame: N(R) in bits 7-5, 0, type in bits 3-2 (00 RR, 10 REJ, 11 SREJ), 01
+// The other frames (SET, UA, DISC, parity) end in 11 and keep their values.
+#define HDLC_I(ns, nr) ((((nr) & 7) << 5) | (((ns) & 7) << 1))
+#define HDLC_RR(nr) ((((nr) & 7) << 5) | 0x01)
+#define HDLC_REJ(nr) ((((nr) & 7) << 5) | 0x09)
+#define HDLC_SREJ(nr) ((((nr) & 7) << 5) | 0x0D)
+#define HDLC_NR(ctrl) (((ctrl) >> 5) & 7)
+
+// Parameters carried in the information field of SET/UA (type, length, value).
+// SET proposes the transmitter settings, UA returns the ones agreed by the receiver.
+#define PARAM_WINDOW_SIZE 1
+#define PARAM_ARQ 2
+#define PARAM_FCS 3
+#define PARAM_MAX_INFO 4 // Largest information field, 2 bytes big-endian
+#define PARAM_FEC 5      // Reed-Solomon parity bytes per block, 0 = no FEC
+#define PARAM_PARITY_GROUP 6 // I-frames per parity frame, 0 = no parity frames
+#define PARAM_DUPLEX 7       // 1 = both ends send I-frames (HDLC control field layout)
+#define PARAM_FRAMING 8      // LinkLayerFraming of I-frames and parity frames
+#define PARAM_FIELD_FCS LlFcsCrc16 // The parameter field itself is always checked with CRC-16
+#define MAX_PARAM_FIELD_SIZE 32
+
+// Sliding window slot
+typedef struct {
+    unsigned char *frame; // Stuffed frame kept until acknowledged, allocated once in llopen
+    int frameSize;
+    long long sentAt;  // monotonicTimeUs() of the last transmission
+    int transmissions; // Karn's rule: no RTT sample from frames sent more than once
+} TxSlot;
+
+// Parity groups (Selective Repeat only): every parityGroup I-frames are followed by a
+// parity frame, from which the receiver rebuilds one lost frame of the group without a
+// round trip. Its information field holds the first sequence number of the group, the
+// frame count, the frame sizes (2 bytes each, room for MAX_PARITY_GROUP) and the XOR
+// of the payloads zero-padded to the longest.
+#define PARITY_HEADER_SIZE (2 + 2 * MAX_PARITY_GROUP)
+
+// Selective Repeat reorder buffer
+typedef struct {
+    unsigned char *data;  // Payload received out of order
+    int size;
+    int received;
+    int srejSent;
+} RxSlot;
+
+// Receiving side of the framing, shared by every frame type
+typedef enum {
+    FRAME_START,
+    FRAME_FLAG_RCV,
+    FRAME_A_RCV,
+    FRAME_C_RCV,
+    FRAME_DATA,
+    FRAME_DATA_ESCAPED,
+} FrameState;
+
+typedef struct {
+    FrameState state;
+    unsigned char addr;
+    unsigned char ctrl;
+    LinkLayerFcs fcs;     // FCS protecting this frame's information field
+    uint32_t acc;         // FCS computed so far over the unstuffed information field
+    unsigned char *info;  // Room for the largest information field we accept plus its FCS
+    int infoCapacity;
+    int infoSize;
+    int overflow;
+    int cobs;             // Information field is COBS encoded rather than byte stuffed
+    CobsDecoder cobsDecoder;
+} Deframer;
+
+// Everything one link needs, so that a process can run several of them
+struct LinkConnection {
+    SerialPort *port;
+    LinkLayerRole role;
+    int frame_number; // Next sequence number to send
+    int retransmissions;
+    int numFramesSent;
+    int numRetransmissions;
+    int numTimeoutRetransmissions; // Resent because the timer expired
+    int numRejectRetransmissions;  // Resent right away on REJ/SREJ
+    int numFramesReceived;
+    int numFramesAcknowledged;
+    int numFramesRejected;
+
+    // Sliding window
+    TxSlot txWindow[8];
+    int windowSize;
+    int seqModulus;
+    int txBase;    // Oldest unacknowledged sequence number (frame_number is the next one)
+    LinkLayerArq arq;
+    LinkLayerFcs fcsType;
+    LinkLayerFraming framing; // SET/UA are always byte stuffed
+    int maxPayload; // Largest information field, negotiated in SET/UA
+    int fecParity;  // Reed-Solomon parity per block of I-frame information field
+    int numFecCorrectedBytes;
+    int numFecCorrectedFrames;
+
+    int fullDuplex;
+    int ackPending; // Full duplex: RR held back for the next I-frame to carry
+    int numPiggybackedAcks;
+
+    // Parity groups
+    int parityGroup;
+    unsigned char *parityField; // Group being accumulated by the transmitter
+    unsigned char *parityFrame;
+    unsigned char *gatherField; // llconnwritev pieces joined for FEC or a parity group
+    int groupCount;
+    int groupXorSize;
+    int numParityFramesSent;
+    int numFramesRecovered;
+
+    // Selective Repeat reorder buffer
+    RxSlot rxWindow[8];
+    int rxExpected; // Next sequence number expected from the peer
+    int rxDeliver;  // Next sequence number handed to the application
+
+    Deframer rxFrame;
+
+    // Receive ring buffer: filled with as many bytes as the port has per read() and
+    // deframed from here. The counters run freely, positions are taken modulo the size.
+    unsigned char rxRing[RX_RING_SIZE];
+    unsigned int rxHead;  // Next byte to deframe
+    unsigned int rxTail;  // Next byte to fill
+    long numReadCalls;
+    long numReadCallsWithData;
+    long numFramesDeframed;
+
+    // Retransmission timer, polled together with the serial port so the link layer
+    // sleeps until a byte arrives or the timer expires.
+    int timerFd;
+    long rtoMs;
+    int timerRunning;
+    int timeoutCount;       // Consecutive expirations without progress
+    long long progressUs;   // When timeoutCount was last reset
+    long timeoutMs;         // Configured timeout
+
+    // Adaptive retransmission timeout, see EVENT LOOP
+    long long srttUs;   // Smoothed round-trip time
+    long long rttvarUs; // Smoothed mean deviation
+    int numRttSamples;
+    int baudRate;
+
+    // Frame size advice, see FRAME SIZE ADVICE
+    double recentTransmissions;
+    double recentFailures;
+    double recentBytes;
+    int recommendedPayload; // Last advice, only moved by changes of 25% or more
+
+    char serialPort[50];
+    char *statsFile; // JSON export, NULL if off
+
+    // Performance statistics, see LLCLOSE
+    long long openedAtUs;
+    long long handshakeUs;         // From llopen to the SET/UA exchange
+    int numSetFrames;
+    long long idleUs;              // Time spent sleeping in poll()
+    long numBytesWritten;          // Everything written to the port, retransmissions included
+    long numBytesRead;
+    long numPayloadBytesSent;      // Accepted by llwrite
+    long numPayloadBytesReceived;  // Handed to the caller of llread
+    long numFrameBytes;            // I-frames as built, before byte stuffing
+    long numStuffingBytes;         // Escapes added to them by byte stuffing
+    long long rttMinUs;
+    long long rttSumUs;
+    int rttHistory[RTT_HISTORY_SIZE]; // Last samples in microseconds, for the percentile
+};
+
+// Connection used by llopen, llwrite, llread and llclose
+static LinkConnection *defaultConnection = NULL;
+
+// Every frame leaves through here, so the statistics count what went on the line
+int writeToPort(LinkConnection *c, const unsigned char *data, int size) {
+    int bytes = serialWrite(c->port, (const char *)data, size);
+    if (bytes > 0) c->numBytesWritten += bytes;
+    return bytes;
+}
 
-volatile int STOP = FALSE;
-int alarmEnabled = FALSE; 
-int alarmCount = 0;
-int frame_number = 0;
-LinkLayerRole role;      
-int timeout = 0;
-int retransmissions = 0;
-static int numFramesSent = 0;
-static int numRetransmissions = 0;
-static numFramesReceived = 0;
-static numFramesAcknowledged = 0;
-static numFramesRejected = 0;
+// Commands from the transmitter and their replies use ADDR_TX,
+// commands from the receiver (DISC) and their replies use ADDR_RX.
+void sendFrameTo(LinkConnection *c, unsigned char address, unsigned char controlByte, const char *frameType) {
+    unsigned char buf_s[BUF_SIZE] = {0};
 
-void alarmHandler(int signal)
-{
-    alarmEnabled = FALSE;
-    alarmCount++;
-    printf("Alarm #%d\n", alarmCount);
+    // Constructing the frame
+    buf_s[0] = FLAG;                  // Flag
+    buf_s[1] = address;               // Address
+    buf_s[2] = controlByte;           // Control
+    buf_s[3] = address ^ controlByte; // BCC
+    buf_s[4] = FLAG;                  // Flag
+
+    int bytes_s = writeToPort(c, buf_s, BUF_SIZE);
+    c->numFramesSent++;
+    printf("%d bytes written (%s Frame)\n", bytes_s, frameType);
 }
 
-void initializeAlarm() {
-    struct sigaction act = {0};
-    act.sa_handler = &alarmHandler;
-    if (sigaction(SIGALRM, &act, NULL) == -1) {
-        perror("sigaction");
-        exit(EXIT_FAILURE);
-    }
+void sendUAFrame(LinkConnection *c, unsigned char address) {
+    sendFrameTo(c, address, CTRL_UA, "UA");
 }
 
-void handleAlarm() {
-    initializeAlarm();
-    alarm(timeout);
-    alarmEnabled = TRUE;
-    if (alarmCount > 0) {
-        numRetransmissions++;
-    }
+void sendDISCFrame(LinkConnection *c, unsigned char address) {
+    sendFrameTo(c, address, CTRL_DISC, "DISC");
 }
 
-void sendFrame(unsigned char controlByte, const char *frameType) {
-    char buf_s[BUF_SIZE] = {0};
+// Address of the I-frames we send and of the replies to them, and the peer's one
+unsigned char ownAddress(LinkConnection *c) {
+    return (c->role == LlTx) ? ADDR_TX : ADDR_RX;
+}
 
-    // Constructing the frame
-    buf_s[0] = FLAG;                  // Flag
-    buf_s[1] = ADDR_TX;               // Address
-    buf_s[2] = controlByte;           // Control
-    buf_s[3] = ADDR_TX ^ controlByte; // BCC
-    buf_s[4] = FLAG;                  // Flag
+unsigned char peerAddress(LinkConnection *c) {
+    return (c->role == LlTx) ? ADDR_RX : ADDR_TX;
+}
 
-    int bytes_s = writeBytes(buf_s, BUF_SIZE);
-    numFramesSent++;
-    printf("%d bytes written (%s Frame)\n", bytes_s, frameType);
+// Control fields for the layout in use, see HDLC_I
+unsigned char ctrlI(LinkConnection *c, int seq) {
+    return c->fullDuplex ? HDLC_I(seq, c->rxExpected) : CTRL_I(seq);
 }
 
-void sendUAFrame() {
-    sendFrame(CTRL_UA, "UA");
+// Supervisory frames answer the peer's I-frames, so they carry its address
+void sendRRFrame(LinkConnection *c, int seq) {
+    char frameType[8];
+    c->numFramesAcknowledged++;
+    c->ackPending = FALSE;
+    snprintf(frameType, sizeof(frameType), "RR%d", seq);
+    sendFrameTo(c, peerAddress(c), c->fullDuplex ? HDLC_RR(seq) : CTRL_RR(seq), frameType);
 }
 
-void sendSETFrame() {
-    sendFrame(CTRL_SET, "SET");
+void sendREJFrame(LinkConnection *c, int seq) {
+    char frameType[8];
+    c->numFramesRejected++;
+    snprintf(frameType, sizeof(frameType), "REJ%d", seq);
+    sendFrameTo(c, peerAddress(c), c->fullDuplex ? HDLC_REJ(seq) : CTRL_REJ(seq), frameType);
 }
 
-void sendDISCFrame() {
-    sendFrame(CTRL_DISC, "DISC");
+void sendSREJFrame(LinkConnection *c, int seq) {
+    char frameType[8];
+    c->numFramesRejected++;
+    snprintf(frameType, sizeof(frameType), "SREJ%d", seq);
+    sendFrameTo(c, peerAddress(c), c->fullDuplex ? HDLC_SREJ(seq) : CTRL_SREJ(seq), frameType);
 }
 
-void sendRRFrame(int seq) {
-    numFramesAcknowledged++;
-    if (seq == 0) {
-        sendFrame(CTRL_RR0, "RR0");
-    } else if (seq == 1) {
-        sendFrame(CTRL_RR1, "RR1");
-    } 
+// Acknowledges the frames received so far. With full duplex the RR waits for the
+// next I-frame to carry it, waitForEvent() sends it if we go to sleep first.
+void acknowledgeReceived(LinkConnection *c) {
+    if (c->fullDuplex) c->ackPending = TRUE;
+    else sendRRFrame(c, c->rxExpected);
 }
 
-void sendREJFrame(int seq) {
-    numFramesRejected++;
-    if (seq == 0) {
-        sendFrame(CTRL_REJ0, "REJ0");
-    } else if (seq == 1) {
-        sendFrame(CTRL_REJ1, "REJ1");
-    } 
+// Control field decoding, return TRUE and the sequence number on a match
+int isIFrame(LinkConnection *c, unsigned char ctrl, int *seq) {
+    if (c->fullDuplex) {
+        if ((ctrl & 0x11) != 0) return FALSE;
+        *seq = (ctrl >> 1) & 7;
+        return TRUE;
+    }
+    if ((ctrl & ~0x58) != 0) return FALSE;
+    *seq = ((ctrl >> 6) & 1) | ((ctrl >> 2) & 6);
+    return TRUE;
 }
 
-void sendIFrame(int seq) {
-    if (seq == 0) {
-        sendFrame(CTRL_I_0, "I0");
-    } else if (seq == 1) {
-        sendFrame(CTRL_I_1, "I1");
+int isRRFrame(LinkConnection *c, unsigned char ctrl, int *seq) {
+    if (c->fullDuplex) {
+        if ((ctrl & 0x1F) != HDLC_RR(0)) return FALSE;
+        *seq = HDLC_NR(ctrl);
+        return TRUE;
     }
+    if ((ctrl & ~0x15) != CTRL_RR0) return FALSE;
+    *seq = (ctrl & 1) | ((ctrl >> 1) & 2) | ((ctrl >> 2) & 4);
+    return TRUE;
 }
 
-int handleStateMachine(LinkLayerState *state, unsigned char byte, unsigned char expectedAddr, unsigned char expectedCtrl, unsigned char expectedBCC) {
-    switch (*state) {
-        case START:
-            if (byte == FLAG) *state = FLAG_RCV;
+int isREJFrame(LinkConnection *c, unsigned char ctrl, int *seq) {
+    if (c->fullDuplex) {
+        if ((ctrl & 0x1F) != HDLC_REJ(0)) return FALSE;
+        *seq = HDLC_NR(ctrl);
+        return TRUE;
+    }
+    if ((ctrl & ~0x0B) != CTRL_REJ0) return FALSE;
+    *seq = (ctrl & 3) | ((ctrl >> 1) & 4);
+    return TRUE;
+}
+
+int isSREJFrame(LinkConnection *c, unsigned char ctrl, int *seq) {
+    if (c->fullDuplex) {
+        if ((ctrl & 0x1F) != HDLC_SREJ(0)) return FALSE;
+        *seq = HDLC_NR(ctrl);
+        return TRUE;
+    }
+    if ((ctrl & ~0x0E) != CTRL_SREJ(0)) return FALSE;
+    *seq = (ctrl >> 1) & 7;
+    return TRUE;
+}
+
+////////////////////////////////////////////////
+// FRAMING
+////////////////////////////////////////////////
+
+void storeInfo(Deframer *f, const unsigned char *data, int size) {
+    if (size > f->infoCapacity - f->infoSize) {
+        size = f->infoCapacity - f->infoSize;
+        f->overflow = TRUE;
+    }
+    memcpy(f->info + f->infoSize, data, size);
+    f->infoSize += size;
+    f->acc = fcsUpdate(f->fcs, f->acc, data, size);
+}
+
+// COBS decodes part of the information field, which never gets longer in the process.
+// The capacity allows for the code bytes, so only a field too long once decoded overflows.
+void decodeCobsInfo(Deframer *f, const unsigned char *data, int size) {
+    int room = f->infoCapacity - f->infoSize;
+    if (size > room) {
+        size = room;
+        f->overflow = TRUE;
+    }
+    int decoded = cobsDecode(&f->cobsDecoder, f->info + f->infoSize, data, size);
+    f->acc = fcsUpdate(f->fcs, f->acc, f->info + f->infoSize, decoded);
+    f->infoSize += decoded;
+}
+
+// Unstuffs one received byte, checking the FCS as the information field goes by.
+// Returns TRUE when a frame with a valid header is complete.
+int deframeByte(LinkConnection *c, Deframer *f, unsigned char byte) {
+    switch (f->state) {
+        case FRAME_START:
+            if (byte == FLAG) f->state = FRAME_FLAG_RCV;
             break;
-        case FLAG_RCV:
-            if (byte == expectedAddr) *state = A_RCV;
-            else if (byte != FLAG) *state = START;
+        case FRAME_FLAG_RCV:
+            if (byte == ADDR_TX || byte == ADDR_RX) {
+                f->addr = byte;
+                f->state = FRAME_A_RCV;
+            } else if (byte != FLAG) {
+                f->state = FRAME_START;
+            }
             break;
-        case A_RCV:
-            if (byte == expectedCtrl) *state = C_RCV;
-            else if (byte == FLAG) *state = FLAG_RCV;
-            else *state = START;
+        case FRAME_A_RCV:
+            if (byte == FLAG) {
+                f->state = FRAME_FLAG_RCV;
+            } else {
+                f->ctrl = byte;
+                f->state = FRAME_C_RCV;
+            }
             break;
-        case C_RCV:
-            if (byte == expectedBCC) *state = BCC_OK;
-            else if (byte == FLAG) *state = FLAG_RCV;
-            else *state = START;
+        case FRAME_C_RCV:
+            if (byte == (f->addr ^ f->ctrl)) {
+                f->state = FRAME_DATA;
+                f->fcs = (f->ctrl == CTRL_SET || f->ctrl == CTRL_UA) ? PARAM_FIELD_FCS : c->fcsType;
+                f->acc = fcsStart(f->fcs);
+                f->infoSize = 0;
+                f->overflow = FALSE;
+                f->cobs = c->framing == LlCobs && f->ctrl != CTRL_SET && f->ctrl != CTRL_UA;
+                f->cobsDecoder.left = 0;
+                f->cobsDecoder.flagPending = FALSE;
+            } else if (byte == FLAG) {
+                f->state = FRAME_FLAG_RCV;
+            } else {
+                f->state = FRAME_START;
+            }
             break;
-        case BCC_OK:
+        case FRAME_DATA:
             if (byte == FLAG) {
-                *state = STOP_STATE;
-                STOP = TRUE;
+                // A COBS block cut short means bytes were lost
+                if (f->cobs && f->cobsDecoder.left > 0) f->overflow = TRUE;
+                // The closing flag may also open the next frame
+                f->state = FRAME_FLAG_RCV;
+                return TRUE;
+            } else if (byte == ESC) {
+                f->state = FRAME_DATA_ESCAPED;
             } else {
-                *state = START;
+                storeInfo(f, &byte, 1);
+            }
+            break;
+        case FRAME_DATA_ESCAPED:
+            if (byte == FLAG) {
+                f->overflow = TRUE;
+                f->state = FRAME_FLAG_RCV;
+                return TRUE;
             }
+            f->state = FRAME_DATA;
+            byte ^= 0x20;
+            storeInfo(f, &byte, 1);
             break;
     }
-    return (*state == STOP_STATE) ? 1 : -1;
+    return FALSE;
 }
 
-int llOpenRx() {
-    LinkLayerState state = START;
-    unsigned char byte;
-    STOP = FALSE;
+// Feeds received bytes to the deframer. Inside the information field, runs without
+// FLAG/ESC are found with the SIMD scanner, then copied and checksummed in bulk.
+// COBS fields are decoded in bulk up to the closing flag.
+// Returns TRUE when a frame is complete, *consumed has the number of bytes used.
+int deframe(LinkConnection *c, Deframer *f, const unsigned char *bytes, int size, int *consumed) {
+    int i = 0;
+    while (i < size) {
+        if (f->state == FRAME_DATA && f->cobs) {
+            // Everything up to the closing flag is decoded in one go
+            const unsigned char *flag = memchr(bytes + i, FLAG, size - i);
+            int run = flag ? flag - (bytes + i) : size - i;
+            decodeCobsInfo(f, bytes + i, run);
+            i += run;
+            if (i == size) break;
+        } else if (f->state == FRAME_DATA) {
+            int run = findFlagOrEsc(bytes + i, size - i);
+            storeInfo(f, bytes + i, run);
+            i += run;
+            if (i == size) break;
+        }
+        if (deframeByte(c, f, bytes[i++])) {
+            *consumed = i;
+            return TRUE;
+        }
+    }
+    *consumed = i;
+    return FALSE;
+}
 
-    while (STOP == FALSE) {
-        if (readByte((char *)&byte) > 0) {
-            if (handleStateMachine(&state, byte, ADDR_TX, CTRL_SET, ADDR_TX ^ CTRL_SET) == 1) {
-                sendUAFrame();
-                return 1;
-            }
+// TRUE if the frame has no information field or its FCS is correct, and an I-frame
+// carries no more than the negotiated payload (the size of llread's packet buffer).
+// The FCS (and FEC parity) is removed from the information field.
+int frameIntact(LinkConnection *c, Deframer *f) {
+    int seq;
+    if (f->overflow) return FALSE;
+    if (f->infoSize == 0) return TRUE;
+
+    int iFrame = isIFrame(c, f->ctrl, &seq);
+    int parity = (c->fecParity > 0 && iFrame) ? c->fecParity : 0;
+    int corrected = 0;
+    int size = checkInfoField(f->info, f->infoSize, f->acc, f->fcs, parity,
+                              iFrame ? c->maxPayload : f->infoCapacity, &corrected);
+    if (size < 0) return FALSE;
+    if (corrected > 0) {
+        c->numFecCorrectedBytes += corrected;
+        c->numFecCorrectedFrames++;
+    }
+    f->infoSize = size;
+    return TRUE;
+}
+
+// Pulls everything the port has (up to the free contiguous space) with one read().
+int fillRing(LinkConnection *c) {
+    unsigned int pos = c->rxTail % RX_RING_SIZE;
+    int space = RX_RING_SIZE - (c->rxTail - c->rxHead);
+    if (space > RX_RING_SIZE - (int)pos) space = RX_RING_SIZE - pos;
+
+    int bytes = serialRead(c->port, (char *)c->rxRing + pos, space);
+    c->numReadCalls++;
+    if (bytes > 0) {
+        c->numReadCallsWithData++;
+        c->numBytesRead += bytes;
+        c->rxTail += bytes;
+    }
+    return bytes;
+}
+
+// Deframes the bytes in the receive ring, waitForEvent() refills it from the port.
+// Returns TRUE with the frame in rxFrame, FALSE once the ring is empty.
+int receiveFrame(LinkConnection *c) {
+    while (c->rxHead != c->rxTail) {
+        unsigned int pos = c->rxHead % RX_RING_SIZE;
+        int available = c->rxTail - c->rxHead;
+        if (available > RX_RING_SIZE - (int)pos) available = RX_RING_SIZE - pos;
+
+        int consumed;
+        int complete = deframe(c, &c->rxFrame, c->rxRing + pos, available, &consumed);
+        c->rxHead += consumed;
+        if (complete) {
+            c->numFramesDeframed++;
+            return TRUE;
         }
     }
-    return -1;
+    return FALSE;
 }
 
-int llOpenTx() {
-    LinkLayerState state = START;
-    unsigned char byte;
-    STOP = FALSE;
+////////////////////////////////////////////////
+// EVENT LOOP
+////////////////////////////////////////////////
+
+// Adaptive retransmission timeout (Jacobson/Karels). The configured timeout is only
+// the initial value, each clean RR round trip then refines the estimate.
+#define MIN_RTO_MS 50
+#define MAX_RTO_MS 60000
+
+// Time to clock size bytes out of the port (8N1, 10 bits per byte). Large frames at
+// low baud rates take seconds to send, which neither the RTT estimate nor the timer
+// may mistake for a lost frame.
+long long serializationUs(LinkConnection *c, int size) {
+    if (c->baudRate <= 0) return 0;
+    return size * 10000000LL / c->baudRate;
+}
 
-    sendSETFrame();
-    initializeAlarm();
-    alarm(timeout);
-    alarmEnabled = TRUE;
+void updateRto(LinkConnection *c, long long sampleUs) {
+    if (c->numRttSamples == 0 || sampleUs < c->rttMinUs) c->rttMinUs = sampleUs;
+    c->rttSumUs += sampleUs;
+    c->rttHistory[c->numRttSamples % RTT_HISTORY_SIZE] = sampleUs;
+
+    if (c->numRttSamples++ == 0) {
+        c->srttUs = sampleUs;
+        c->rttvarUs = sampleUs / 2;
+    } else {
+        long long error = sampleUs - c->srttUs;
+        if (error < 0) error = -error;
+        c->rttvarUs += (error - c->rttvarUs) / 4;
+        c->srttUs += (sampleUs - c->srttUs) / 8;
+    }
+
+    c->rtoMs = (c->srttUs + 4 * c->rttvarUs + 999) / 1000;
+    if (c->rtoMs < MIN_RTO_MS) c->rtoMs = MIN_RTO_MS;
+    if (c->rtoMs > MAX_RTO_MS) c->rtoMs = MAX_RTO_MS;
+}
+
+// Exponential backoff, kept until a frame is acknowledged without being retransmitted.
+// Backing off past the configured timeout would only delay giving up, unless the
+// measured RTT already needs more.
+void backoffRto(LinkConnection *c) {
+    long ceiling = (c->rtoMs <= c->timeoutMs) ? c->timeoutMs : MAX_RTO_MS;
+    c->rtoMs *= 2;
+    if (c->rtoMs > ceiling) c->rtoMs = ceiling;
+}
+
+// A short RTO only speeds up retransmissions, the link is given up after as long
+// without progress as the configured timeout and nRetransmissions allow.
+void resetTimeouts(LinkConnection *c) {
+    c->timeoutCount = 0;
+    c->progressUs = monotonicTimeUs();
+}
+
+int retransmissionsExhausted(LinkConnection *c) {
+    return c->timeoutCount >= c->retransmissions && monotonicTimeUs() - c->progressUs >= c->timeoutMs * 1000LL * c->retransmissions;
+}
 
-    while (STOP == FALSE && alarmCount < retransmissions) {
-        if (!alarmEnabled) {
-            handleAlarm();
-            if (alarmCount >= retransmissions) return -1;
-            sendSETFrame();
+// Number of frames sent but not yet acknowledged
+int framesOutstanding(LinkConnection *c) {
+    return (c->frame_number - c->txBase + c->seqModulus) % c->seqModulus;
+}
+
+void startRetransmissionTimer(LinkConnection *c) {
+    long ms = c->rtoMs;
+    // The oldest frame has to leave the port before its acknowledgement can come back
+    if (framesOutstanding(c) > 0) ms += serializationUs(c, c->txWindow[c->txBase].frameSize) / 1000;
+    startTimer(c->timerFd, ms);
+    c->timerRunning = TRUE;
+}
+
+void stopRetransmissionTimer(LinkConnection *c) {
+    stopTimer(c->timerFd);
+    c->timerRunning = FALSE;
+}
+
+// Waits up to timeoutMs (-1 for no limit) for the serial port to have data or the
+// retransmission timer to expire, and handles whichever happened. Received bytes
+// are moved to the receive ring, so read() is only called when it has something.
+void waitForEvent(LinkConnection *c, int timeoutMs) {
+    // No I-frame will carry a delayed acknowledgement while we sleep
+    if (timeoutMs != 0 && c->ackPending) sendRRFrame(c, c->rxExpected);
+
+    struct pollfd fds[2] = {
+        {.fd = serialFd(c->port), .events = POLLIN},
+        {.fd = c->timerFd, .events = POLLIN},
+    };
+
+    long long idleSince = monotonicTimeUs();
+    int ready = poll(fds, 2, timeoutMs);
+    c->idleUs += monotonicTimeUs() - idleSince;
+    if (ready < 0) {
+        if (errno != EINTR) perror("poll");
+        return;
+    }
+
+    if (fds[0].revents & (POLLIN | POLLERR | POLLHUP)) fillRing(c);
+
+    if ((fds[1].revents & POLLIN) && timerExpired(c->timerFd)) {
+        c->timerRunning = FALSE;
+        c->timeoutCount++;
+        backoffRto(c);
+        printf("Timeout #%d, rto = %ld ms\n", c->timeoutCount, c->rtoMs);
+    }
+}
+
+////////////////////////////////////////////////
+// PARAMETER NEGOTIATION
+////////////////////////////////////////////////
+
+int buildParameters(LinkConnection *c, unsigned char *params) {
+    int size = 0;
+    params[size++] = PARAM_WINDOW_SIZE;
+    params[size++] = 1;
+    params[size++] = c->windowSize;
+    params[size++] = PARAM_ARQ;
+    params[size++] = 1;
+    params[size++] = c->arq;
+    params[size++] = PARAM_FCS;
+    params[size++] = 1;
+    params[size++] = c->fcsType;
+    params[size++] = PARAM_MAX_INFO;
+    params[size++] = 2;
+    params[size++] = c->maxPayload >> 8;
+    params[size++] = c->maxPayload & 0xFF;
+    params[size++] = PARAM_FEC;
+    params[size++] = 1;
+    params[size++] = c->fecParity;
+    params[size++] = PARAM_PARITY_GROUP;
+    params[size++] = 1;
+    params[size++] = c->parityGroup;
+    params[size++] = PARAM_DUPLEX;
+    params[size++] = 1;
+    params[size++] = c->fullDuplex;
+    params[size++] = PARAM_FRAMING;
+    params[size++] = 1;
+    params[size++] = c->framing;
+    return size;
+}
+
+// Returns the number of bytes written
+int sendParameterFrame(LinkConnection *c, unsigned char ctrl, const char *frameType) {
+    unsigned char params[MAX_PARAM_FIELD_SIZE];
+    unsigned char frame[MAX_FRAME_SIZE(MAX_PARAM_FIELD_SIZE)];
+    int paramsSize = buildParameters(c, params);
+    int frameSize = encodeFrame(frame, ADDR_TX, ctrl, params, paramsSize, PARAM_FIELD_FCS, LlByteStuffing);
+
+    int bytes_s = writeToPort(c, frame, frameSize);
+    c->numFramesSent++;
+    printf("%d bytes written (%s Frame, window = %d, arq = %d, fcs = %d, max info = %d, fec = %d, duplex = %d, framing = %d)\n",
+           bytes_s, frameType, c->windowSize, c->arq, c->fcsType, c->maxPayload, c->fecParity, c->fullDuplex, c->framing);
+    return bytes_s;
+}
+
+int sendSETFrame(LinkConnection *c) {
+    return sendParameterFrame(c, CTRL_SET, "SET");
+}
+
+// Combines the peer parameters with ours: the smallest window and information field,
+// the transmitter's ARQ mode and parity groups, and the strongest FCS and FEC. The receiver applies it to SET and answers with the
+// result in UA, which the transmitter then applies unchanged.
+void applyParameters(LinkConnection *c, const unsigned char *params, int size) {
+    if (size == 0) {
+        // Peer without parameter support: plain stop-and-wait with BCC2
+        c->windowSize = 1;
+        c->arq = LlGoBackN;
+        c->fcsType = LlFcsBcc2;
+        if (c->maxPayload > MAX_PAYLOAD_SIZE) c->maxPayload = MAX_PAYLOAD_SIZE;
+        c->fecParity = 0;
+    }
+
+    int groupGiven = FALSE;
+    int duplexGiven = FALSE;
+    int framingGiven = FALSE;
+    for (int i = 0; i + 2 < size && i + 2 + params[i + 1] <= size; i += 2 + params[i + 1]) {
+        unsigned int value = 0;
+        for (int j = 0; j < params[i + 1] && j < 4; j++) value = (value << 8) | params[i + 2 + j];
+        switch (params[i]) {
+            case PARAM_WINDOW_SIZE:
+                if (value >= 1 && value < c->windowSize) c->windowSize = value;
+                break;
+            case PARAM_ARQ:
+                if (value <= LlSelectiveRepeat) c->arq = value;
+                break;
+            case PARAM_FCS:
+                if (value <= LlFcsCrc32 && value > c->fcsType) c->fcsType = value;
+                break;
+            case PARAM_MAX_INFO:
+                if (value >= 1 && value < (unsigned int)c->maxPayload) c->maxPayload = value;
+                break;
+            case PARAM_FEC:
+                if (value <= RS_MAX_PARITY && value > (unsigned int)c->fecParity) c->fecParity = value;
+                break;
+            case PARAM_PARITY_GROUP:
+                c->parityGroup = (value <= MAX_PARITY_GROUP) ? value : MAX_PARITY_GROUP;
+                groupGiven = TRUE;
+                break;
+            case PARAM_DUPLEX:
+                if (value < (unsigned int)c->fullDuplex) c->fullDuplex = value;
+                duplexGiven = TRUE;
+                break;
+            case PARAM_FRAMING:
+                if (value < (unsigned int)c->framing) c->framing = value;
+                framingGiven = TRUE;
+                break;
+            default:
+                break; // Unknown parameters are ignored
         }
+    }
+
+    // Full duplex needs both ends to ask for it
+    if (!duplexGiven) c->fullDuplex = FALSE;
+    // So does COBS, an older peer would take the code bytes for data
+    if (!framingGiven) c->framing = LlByteStuffing;
+    if (c->arq == LlSelectiveRepeat && c->windowSize > MAX_SR_WINDOW_SIZE) c->windowSize = MAX_SR_WINDOW_SIZE;
+    // With full duplex, frames received while writing wait for llread in the reorder
+    // buffer, which needs more sequence numbers than stop-and-wait
+    c->seqModulus = (c->windowSize > 1 || c->fullDuplex) ? 8 : 2;
+    // Recovery needs the reorder buffer, and a peer that did not echo the group ignores it
+    if (!groupGiven || c->arq != LlSelectiveRepeat || c->windowSize == 1) c->parityGroup = 0;
+    // Parity frames only go from transmitter to receiver
+    if (c->fullDuplex) c->parityGroup = 0;
+}
 
-        if (readByte((char *)&byte) > 0) {
-            if (handleStateMachine(&state, byte, ADDR_TX, CTRL_UA, ADDR_TX ^ CTRL_UA) == 1) {
-                alarm(0);
-                alarmEnabled = FALSE;
-                alarmCount = 0;
-                return 1;
+int llOpenRx(LinkConnection *c) {
+    long long startUs = monotonicTimeUs();
+    while (TRUE) {
+        if (!receiveFrame(c)) {
+            waitForEvent(c, -1);
+            continue;
+        }
+
+        if (c->rxFrame.addr == ADDR_TX && c->rxFrame.ctrl == CTRL_SET && frameIntact(c, &c->rxFrame)) {
+            applyParameters(c, c->rxFrame.info, c->rxFrame.infoSize);
+            sendParameterFrame(c, CTRL_UA, "UA");
+            c->handshakeUs = monotonicTimeUs() - startUs;
+            printf("llopen: Connection established in %.1f ms\n", c->handshakeUs / 1000.0);
+            return 1;
+        }
+    }
+    return -1;
+}
+
+// Fast open: a receiver started after the transmitter would otherwise only see the
+// SET repeated after a whole timeout. SET is repeated OPEN_RETRY_MS after the time
+// for SET and UA to cross the line, the interval growing by half each time up to
+// OPEN_MAX_RETRY_MS (or the configured timeout if shorter), until nRetransmissions
+// timeouts have passed. The retransmission timer is left alone, so the data phase
+// starts from the configured timeout.
+#define OPEN_RETRY_MS 20
+#define OPEN_MAX_RETRY_MS 250
+
+int llOpenTx(LinkConnection *c) {
+    long long startUs = monotonicTimeUs();
+    long long deadlineUs = startUs + c->rtoMs * 1000LL * c->retransmissions;
+    long long nextSetUs = startUs;
+    long retryMs = 0;
+    long maxRetryMs = (c->rtoMs < OPEN_MAX_RETRY_MS) ? c->rtoMs : OPEN_MAX_RETRY_MS;
+
+    while (TRUE) {
+        long long now = monotonicTimeUs();
+        if (now >= nextSetUs) {
+            if (now >= deadlineUs) return -1;
+            int bytes = sendSETFrame(c);
+            if (c->numSetFrames++ == 0) {
+                retryMs = OPEN_RETRY_MS + serializationUs(c, 2 * bytes) / 1000;
+                if (maxRetryMs < retryMs) maxRetryMs = retryMs;
+            } else {
+                retryMs += retryMs / 2;
+                if (retryMs > maxRetryMs) retryMs = maxRetryMs;
             }
+            nextSetUs = now + retryMs * 1000;
+        }
+
+        if (!receiveFrame(c)) {
+            waitForEvent(c, (nextSetUs - now + 999) / 1000);
+            continue;
+        }
+
+        if (c->rxFrame.addr == ADDR_TX && c->rxFrame.ctrl == CTRL_UA && frameIntact(c, &c->rxFrame)) {
+            applyParameters(c, c->rxFrame.info, c->rxFrame.infoSize);
+            c->handshakeUs = monotonicTimeUs() - startUs;
+            printf("llopen: Connection established in %.1f ms (%d SET frames, window = %d, arq = %d, fcs = %d, max info = %d, fec = %d, parity group = %d, duplex = %d, framing = %d)\n",
+                   c->handshakeUs / 1000.0, c->numSetFrames, c->windowSize, c->arq, c->fcsType, c->maxPayload,
+                   c->fecParity, c->parityGroup, c->fullDuplex, c->framing);
+            return 1;
         }
     }
     return -1;
 }
 
+////////////////////////////////////////////////
+// FRAME SIZE ADVICE
+////////////////////////////////////////////////
+
+// Counts of recent I-frame transmissions, of those that had to be repeated (REJ, SREJ
+// or timeout) and of the bytes they carried. Older outcomes fade out exponentially
+// as the next RECENT_BYTES bytes are sent.
+#define RECENT_BYTES (128 * 1024)
+#define PAYLOAD_STEP 128
+
+void recordFrameOutcome(LinkConnection *c, const TxSlot *slot) {
+    double keep = 1 - (double)slot->frameSize / RECENT_BYTES;
+    if (keep < 0.5) keep = 0.5;
+    for (int i = 0; i < slot->transmissions; i++) {
+        int failed = i < slot->transmissions - 1;
+        c->recentTransmissions = c->recentTransmissions * keep + 1;
+        c->recentFailures = c->recentFailures * keep + failed;
+        c->recentBytes = c->recentBytes * keep + slot->frameSize;
+    }
+}
+
+// Newton's method, the build does not link libm
+double squareRoot(double x) {
+    if (x <= 0) return 0;
+    double r = x > 1 ? x : 1;
+    for (int i = 0; i < 64; i++) {
+        double next = (r + x / r) / 2;
+        if (next >= r) break;
+        r = next;
+    }
+    return r;
+}
+
+int llconnrecommendedpayload(LinkConnection *c, double *errorRate) {
+    if (errorRate) *errorRate = c->recentTransmissions > 0 ? c->recentFailures / c->recentTransmissions : 0;
+
+    int size = c->maxPayload;
+    if (c->recentFailures >= 1e-3 && c->recentBytes >= 1) {
+        // q is the chance that a given byte is corrupted (failures per byte sent). With h
+        // bytes of overhead per frame (header, FCS, RR and, in stop-and-wait, the round trip
+        // spent waiting for it) the efficiency L / (L + h) * (1 - q)^(L + h) peaks at
+        // L = (sqrt(h^2 + 4h / q) - h) / 2, close to sqrt(h / q) on a clean cable.
+        double q = c->recentFailures / c->recentBytes;
+        double h = 2 * BUF_SIZE + fcsLength(c->fcsType);
+        if (c->windowSize == 1) h += c->srttUs * c->baudRate / 10000000.0;
+        double best = (squareRoot(h * h + 4 * h / q) - h) / 2;
+
+        size = (int)(best / PAYLOAD_STEP) * PAYLOAD_STEP;
+        if (size < PAYLOAD_STEP) size = PAYLOAD_STEP;
+        if (size > c->maxPayload) size = c->maxPayload;
+    }
+
+    if (c->recommendedPayload == 0 || size * 4 <= c->recommendedPayload * 3 || size * 4 >= c->recommendedPayload * 5
+        || size == c->maxPayload) {
+        c->recommendedPayload = size;
+    }
+    return c->recommendedPayload;
+}
+
+int llrecommendedpayload(double *errorRate) {
+    return llconnrecommendedpayload(defaultConnection, errorRate);
+}
+
 ////////////////////////////////////////////////
 // LLOPEN
 ////////////////////////////////////////////////
-int llopen(LinkLayer connectionParameters) {
-    role = connectionParameters.role;
-    retransmissions = connectionParameters.nRetransmissions;
-    timeout = connectionParameters.timeout;
+// Releases the port, the timer and the buffers of a connection, and the connection itself
+void freeConnection(LinkConnection *c) {
+    if (c->port != NULL) serialClose(c->port);
+    if (c->timerFd >= 0) destroyTimer(c->timerFd);
+    for (int i = 0; i < 8; i++) {
+        free(c->txWindow[i].frame);
+        free(c->rxWindow[i].data);
+    }
+    free(c->rxFrame.info);
+    free(c->parityField);
+    free(c->parityFrame);
+    free(c->gatherField);
+    free(c->statsFile);
+    free(c);
+}
 
-    if (openSerialPort(connectionParameters.serialPort, connectionParameters.baudRate) < 0) {
-        return -1;
+LinkConnection *llconnopen(LinkLayer connectionParameters) {
+    LinkConnection *c = (LinkConnection *) calloc(1, sizeof(LinkConnection));
+    if (c == NULL) return NULL;
+    c->timerFd = -1;
+    c->openedAtUs = monotonicTimeUs();
+
+    c->role = connectionParameters.role;
+    strncpy(c->serialPort, connectionParameters.serialPort, sizeof(c->serialPort) - 1);
+    if (connectionParameters.statsFile != NULL && connectionParameters.statsFile[0] != '\0')
+        c->statsFile = strdup(connectionParameters.statsFile);
+    c->retransmissions = connectionParameters.nRetransmissions;
+    c->rtoMs = connectionParameters.timeoutMs > 0 ? connectionParameters.timeoutMs
+                                                  : connectionParameters.timeout * 1000L;
+    c->timeoutMs = c->rtoMs;
+    c->baudRate = connectionParameters.baudRate;
+
+    c->windowSize = connectionParameters.windowSize;
+    if (c->windowSize < 1) c->windowSize = 1;
+    if (c->windowSize > MAX_WINDOW_SIZE) c->windowSize = MAX_WINDOW_SIZE;
+    c->arq = connectionParameters.arq;
+    if (c->arq == LlSelectiveRepeat && c->windowSize > MAX_SR_WINDOW_SIZE) c->windowSize = MAX_SR_WINDOW_SIZE;
+    c->fcsType = connectionParameters.fcs;
+    if (c->fcsType > LlFcsCrc32) c->fcsType = LlFcsCrc32;
+    c->seqModulus = (c->windowSize > 1) ? 8 : 2;
+    c->maxPayload = connectionParameters.maxPayloadSize;
+    if (c->maxPayload < 1) c->maxPayload = MAX_PAYLOAD_SIZE;
+    if (c->maxPayload > MAX_NEGOTIATED_PAYLOAD_SIZE) c->maxPayload = MAX_NEGOTIATED_PAYLOAD_SIZE;
+    c->fecParity = connectionParameters.fecParity;
+    if (c->fecParity < 0) c->fecParity = 0;
+    if (c->fecParity > RS_MAX_PARITY) c->fecParity = RS_MAX_PARITY;
+    c->parityGroup = connectionParameters.parityGroup;
+    if (c->parityGroup < 0) c->parityGroup = 0;
+    if (c->parityGroup > MAX_PARITY_GROUP) c->parityGroup = MAX_PARITY_GROUP;
+    c->fullDuplex = connectionParameters.fullDuplex ? TRUE : FALSE;
+    c->framing = (connectionParameters.framing == LlCobs) ? LlCobs : LlByteStuffing;
+    c->rxFrame.state = FRAME_START;
+    framingInit();
+
+    // The negotiated information field can only shrink, but the peer may ask for FEC
+    // parity or send parity frames. COBS is decoded in place of the received bytes, so
+    // the field must also hold its code bytes.
+    c->rxFrame.infoCapacity = COBS_FIELD_SIZE(FEC_FIELD_SIZE(PARITY_HEADER_SIZE + c->maxPayload + MAX_FCS_SIZE, RS_MAX_PARITY));
+    c->rxFrame.info = (unsigned char *) malloc(c->rxFrame.infoCapacity);
+
+    c->port = serialOpen(connectionParameters.serialPort, connectionParameters.baudRate);
+    c->timerFd = createTimer();
+    if (c->port == NULL || c->timerFd < 0) {
+        freeConnection(c);
+        return NULL;
     }
 
+    int result = -1;
     if (connectionParameters.role == LlRx) {
-        return llOpenRx();
+        result = llOpenRx(c);
     } else if (connectionParameters.role == LlTx) {
-        return llOpenTx();
+        result = llOpenTx(c);
+    }
+    if (result < 0) {
+        freeConnection(c);
+        return NULL;
     }
 
-    return -1;
+    // Transmit buffers sized for the negotiated worst case, so llwrite never allocates
+    if (c->role == LlTx || c->fullDuplex) {
+        for (int i = 0; i < 8; i++) {
+            c->txWindow[i].frame = (unsigned char *) malloc(MAX_FEC_FRAME_SIZE(c->maxPayload, c->fecParity));
+        }
+        if (c->parityGroup > 0) {
+            c->parityField = (unsigned char *) calloc(PARITY_HEADER_SIZE + c->maxPayload, 1);
+            c->parityFrame = (unsigned char *) malloc(MAX_FRAME_SIZE(PARITY_HEADER_SIZE + c->maxPayload));
+        }
+        if (c->fecParity > 0 || c->parityGroup > 0) c->gatherField = (unsigned char *) malloc(c->maxPayload);
+    }
+
+    // Allocated whatever the ARQ mode, a repeated SET is still answered from llread
+    if (c->role == LlRx || c->fullDuplex) {
+        for (int i = 0; i < 8; i++) {
+            c->rxWindow[i].data = (unsigned char *) malloc(c->maxPayload);
+        }
+    }
+
+    return c;
 }
 
+int llopen(LinkLayer connectionParameters) {
+    defaultConnection = llconnopen(connectionParameters);
+    return defaultConnection != NULL ? 1 : -1;
+}
 
-int handleLlwriteStateTransition(LinkLayerState *state, unsigned char byte, unsigned char *cField) {
-    int reject = 0;
-    switch (*state) {
-        case START:
-            if (byte == FLAG){ *state = FLAG_RCV;}
-            else{
-                printf("%X \n", byte);
-            }
-            break;
-        case FLAG_RCV:
-            if (byte == ADDR_TX) *state = A_RCV;
-            else if (byte != FLAG) *state = START;
-            break;
-        case A_RCV:
-            if (byte == CTRL_RR0 && frame_number == 1) {
-                *state = C_RCV;
-                *cField = CTRL_RR0;
-            } else if (byte == CTRL_RR1 && frame_number == 0) {
-                *state = C_RCV;
-                *cField = CTRL_RR1;
-            } else if (byte == CTRL_REJ0 && frame_number == 0) {
-                *state = C_RCV;
-                reject = 1;
-            } else if (byte == CTRL_REJ1 && frame_number == 1) {
-                *state = C_RCV;
-                reject = 1;
-            } else if (byte == CTRL_DISC) {
-                *state = C_RCV;
-                *cField = CTRL_DISC;
-            } else if (byte == FLAG) {
-                *state = FLAG_RCV;
-            } else {
-                *state = START;
-            }
-            break;
-        case C_RCV:
-            if (byte == (ADDR_TX ^ *cField) && reject != 1) {
-                *state = BCC_OK;
-            } else if (byte == FLAG) {
-                *state = FLAG_RCV;
-            } else {
-                *state = START;
-            }
-            reject = 0;
-            break;
-        case BCC_OK:
-            return 1; 
-        default:
-            break;
+int llconnmaxpayload(LinkConnection *c) {
+    return c->maxPayload;
+}
+
+int llmaxpayload() {
+    return llconnmaxpayload(defaultConnection);
+}
+
+
+////////////////////////////////////////////////
+// SLIDING WINDOW
+////////////////////////////////////////////////
+
+// Sets N(R) in a frame about to be sent again (the header is never stuffed)
+void refreshAcknowledgement(LinkConnection *c, unsigned char *frame, int seq) {
+    frame[2] = ctrlI(c, seq);
+    frame[3] = frame[1] ^ frame[2];
+    if (c->ackPending) c->numPiggybackedAcks++;
+    c->ackPending = FALSE;
+}
+
+void retransmitFrame(LinkConnection *c, int seq, int onReject) {
+    if (c->fullDuplex) refreshAcknowledgement(c, c->txWindow[seq].frame, seq);
+    writeToPort(c, c->txWindow[seq].frame, c->txWindow[seq].frameSize);
+    c->txWindow[seq].sentAt = monotonicTimeUs();
+    c->txWindow[seq].transmissions++;
+    c->numFramesSent++;
+    c->numRetransmissions++;
+    if (onReject) c->numRejectRetransmissions++;
+    else c->numTimeoutRetransmissions++;
+    printf("llwrite: Retransmitted frame, size = %d, frame_number = %d\n", c->txWindow[seq].frameSize, seq);
+}
+
+// On timeout Go-Back-N resends every outstanding frame, starting with the oldest one.
+// Selective Repeat only resends the oldest, the receiver asks for the others with SREJ.
+void retransmitWindow(LinkConnection *c) {
+    if (c->arq == LlSelectiveRepeat) {
+        retransmitFrame(c, c->txBase, FALSE);
+        return;
+    }
+    for (int seq = c->txBase; seq != c->frame_number; seq = (seq + 1) % c->seqModulus) {
+        retransmitFrame(c, seq, FALSE);
     }
-    return 0; 
 }
 
+// RR(n) is cumulative: it acknowledges every outstanding frame before n
+int acknowledgeFrames(LinkConnection *c, int nextExpected) {
+    int acked = (nextExpected - c->txBase + c->seqModulus) % c->seqModulus;
+    if (acked == 0 || acked > framesOutstanding(c)) return FALSE;
+
+    // The RR answers the newest frame it covers
+    TxSlot *last = &c->txWindow[(nextExpected - 1 + c->seqModulus) % c->seqModulus];
+    if (last->transmissions == 1) {
+        long long rtt = monotonicTimeUs() - last->sentAt - serializationUs(c, last->frameSize);
+        updateRto(c, rtt > 0 ? rtt : 0);
+    }
 
-unsigned char* buildFrame(const unsigned char *buf, int bufSize, int *frameSize) {
-    int oldFrameSize = bufSize + 6;
-    unsigned char *oldFrame = (unsigned char*) malloc(oldFrameSize);
+    for (int seq = c->txBase; seq != nextExpected; seq = (seq + 1) % c->seqModulus) {
+        recordFrameOutcome(c, &c->txWindow[seq]);
+    }
 
-    oldFrame[0] = FLAG;
-    oldFrame[1] = ADDR_TX;
-    oldFrame[2] = frame_number == 0 ? CTRL_I_0 : CTRL_I_1;
-    oldFrame[3] = ADDR_TX ^ (frame_number == 0 ? CTRL_I_0 : CTRL_I_1);
+    c->txBase = nextExpected;
+    return TRUE;
+}
 
-    unsigned char BCC2 = 0;
-    for (int i = 0; i < bufSize; i++) {
-        oldFrame[i + 4] = buf[i];
-        BCC2 ^= buf[i];
+// Resends the window when the retransmission timer has expired.
+// Returns -1 when the maximum number of retransmissions is reached, 0 otherwise.
+int serviceTimer(LinkConnection *c) {
+    if (!c->timerRunning && framesOutstanding(c) > 0) {
+        if (retransmissionsExhausted(c)) {
+            printf("llwrite: Maximum retransmissions reached, transmission failed.\n");
+            return -1;
+        }
+        retransmitWindow(c);
+        startRetransmissionTimer(c);
     }
+    return 0;
+}
 
-    oldFrame[bufSize + 4] = BCC2;
-    oldFrame[bufSize + 5] = FLAG;
+void framesAcknowledged(LinkConnection *c, int seq) {
+    printf("llwrite: Frames acknowledged up to %d.\n", seq);
+    resetTimeouts(c);
+    if (framesOutstanding(c) > 0) startRetransmissionTimer(c);
+    else stopRetransmissionTimer(c);
+}
+
+// Handles the acknowledgements in the received frame: RR, REJ and SREJ, and with full
+// duplex the N(R) of the peer's I-frames. Returns TRUE if there is nothing else in it.
+int handleAcknowledgement(LinkConnection *c) {
+    unsigned char cField = c->rxFrame.ctrl;
+    int seq;
 
-    *frameSize = oldFrameSize;
-    return oldFrame;
+    if (c->fullDuplex && c->rxFrame.addr == peerAddress(c) && isIFrame(c, cField, &seq)) {
+        if (acknowledgeFrames(c, HDLC_NR(cField))) framesAcknowledged(c, HDLC_NR(cField));
+        return FALSE;
+    }
+    if (c->rxFrame.addr != ownAddress(c) || c->rxFrame.infoSize != 0) return FALSE;
+
+    if (isRRFrame(c, cField, &seq)) {
+        if (acknowledgeFrames(c, seq)) framesAcknowledged(c, seq);
+    } else if (isREJFrame(c, cField, &seq)) {
+        // REJ(n) acknowledges the frames before n and asks for n onwards again,
+        // resend them now instead of waiting for the timer
+        if (acknowledgeFrames(c, seq)) framesAcknowledged(c, seq);
+        if (framesOutstanding(c) == 0 || seq != c->txBase) return TRUE;
+        printf("llwrite: Frame %d rejected, going back.\n", seq);
+        for (int n = c->txBase; n != c->frame_number; n = (n + 1) % c->seqModulus) {
+            retransmitFrame(c, n, TRUE);
+        }
+        startRetransmissionTimer(c);
+    } else if (isSREJFrame(c, cField, &seq)) {
+        if ((seq - c->txBase + c->seqModulus) % c->seqModulus >= framesOutstanding(c)) return TRUE;
+        printf("llwrite: Frame %d selectively rejected.\n", seq);
+        retransmitFrame(c, seq, TRUE);
+    } else {
+        return FALSE;
+    }
+    return TRUE;
 }
 
-unsigned char* byteStuffing(const unsigned char *oldFrame, int oldFrameSize, int *newFrameSize) {
-    unsigned char *newFrame = (unsigned char*) malloc(oldFrameSize * 2);
+int handleReceivedFrame(LinkConnection *c, unsigned char *packet);
 
-    int newSize = 0;
-    for (int j = 0; j < 4; j++) {
-        newFrame[newSize++] = oldFrame[j];
+// Consumes the frames available on the port and handles the retransmission timer.
+// With full duplex the peer's I-frames are kept for llread.
+// Returns -1 when the maximum number of retransmissions is reached, 0 otherwise.
+int serviceWindow(LinkConnection *c) {
+    if (serviceTimer(c) < 0) return -1;
+
+    while (receiveFrame(c)) {
+        if (!handleAcknowledgement(c) && c->fullDuplex) handleReceivedFrame(c, NULL);
     }
+    return 0;
+}
 
-    for (int j = 4; j < oldFrameSize - 1; j++) {
-        if (oldFrame[j] == FLAG) {
-            newFrame[newSize++] = ESC;
-            newFrame[newSize++] = 0x5e;
-        } else if (oldFrame[j] == ESC) {
-            newFrame[newSize++] = ESC;
-            newFrame[newSize++] = 0x5d;
-        } else {
-            newFrame[newSize++] = oldFrame[j];
+// Services the window, sleeping between rounds, until at most maxOutstanding frames
+// are unacknowledged. Returns -1 when the maximum number of retransmissions is reached.
+int waitForWindow(LinkConnection *c, int maxOutstanding) {
+    waitForEvent(c, 0); // Acknowledgements that arrived while sending
+    if (serviceWindow(c) < 0) return -1;
+    while (framesOutstanding(c) > maxOutstanding) {
+        waitForEvent(c, -1);
+        if (serviceWindow(c) < 0) return -1;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////
+// REORDER BUFFER
+////////////////////////////////////////////////
+
+// TRUE if seq falls in the receive window starting at the next expected frame, and
+// the reorder buffer has room for it next to the frames the application has not read
+// yet (full duplex, received while writing).
+int inReceiveWindow(LinkConnection *c, int seq) {
+    if ((seq - c->rxExpected + c->seqModulus) % c->seqModulus >= c->windowSize) return FALSE;
+    return (seq - c->rxDeliver + c->seqModulus) % c->seqModulus < c->seqModulus - 1;
+}
+
+// Keeps a frame that arrived ahead of the next expected one
+void bufferFrame(LinkConnection *c, int seq, const unsigned char *data, int size) {
+    if (c->rxWindow[seq].received) return;
+    if (size > c->maxPayload) size = c->maxPayload;
+    memcpy(c->rxWindow[seq].data, data, size);
+    c->rxWindow[seq].size = size;
+    c->rxWindow[seq].received = TRUE;
+    c->rxWindow[seq].srejSent = FALSE;
+}
+
+// Sends one SREJ for each missing frame before seq that was not requested yet
+void requestMissingFrames(LinkConnection *c, int seq) {
+    for (int s = c->rxExpected; s != seq; s = (s + 1) % c->seqModulus) {
+        if (!c->rxWindow[s].received && !c->rxWindow[s].srejSent) {
+            sendSREJFrame(c, s);
+            c->rxWindow[s].srejSent = TRUE;
         }
     }
+}
 
-    newFrame[newSize++] = FLAG;
+////////////////////////////////////////////////
+// PARITY GROUPS
+////////////////////////////////////////////////
 
-    newFrame = realloc(newFrame, newSize);
-    *newFrameSize = newSize;
+void addToParityGroup(LinkConnection *c, int seq, const unsigned char *buf, int size) {
+    if (c->groupCount == 0) c->parityField[0] = seq;
+    c->parityField[2 + 2 * c->groupCount] = size >> 8;
+    c->parityField[3 + 2 * c->groupCount] = size & 0xFF;
+    c->groupCount++;
+    c->parityField[1] = c->groupCount;
 
-    return newFrame;
+    unsigned char *xor = c->parityField + PARITY_HEADER_SIZE;
+    for (int i = 0; i < size; i++) xor[i] ^= buf[i];
+    if (size > c->groupXorSize) c->groupXorSize = size;
+}
+
+// Sends the parity of the frames added since the last one and starts a new group
+void sendParityFrame(LinkConnection *c) {
+    int frameSize = encodeFrame(c->parityFrame, ADDR_TX, CTRL_PARITY, c->parityField,
+                                PARITY_HEADER_SIZE + c->groupXorSize, c->fcsType, c->framing);
+    writeToPort(c, c->parityFrame, frameSize);
+    c->numParityFramesSent++;
+    printf("llwrite: Parity frame sent, %d frames from %d\n", c->groupCount, c->parityField[0]);
+
+    memset(c->parityField, 0, PARITY_HEADER_SIZE + c->groupXorSize);
+    c->groupCount = 0;
+    c->groupXorSize = 0;
+}
+
+// Rebuilds the one frame of a group that is neither delivered nor buffered into its
+// reorder buffer slot. Delivered frames are still in their slots: with at most
+// MAX_PARITY_GROUP frames per group and MAX_SR_WINDOW_SIZE in the window, a slot is
+// not reused before its group is over. Returns the sequence number recovered, or -1
+// if the group is complete or lost more than one frame.
+int recoverFromParity(LinkConnection *c, const unsigned char *field, int size) {
+    if (size < PARITY_HEADER_SIZE) return -1;
+    int first = field[0] % c->seqModulus;
+    int count = field[1];
+    if (count < 1 || count > MAX_PARITY_GROUP) return -1;
+
+    int missing = -1;
+    for (int k = 0; k < count; k++) {
+        int seq = (first + k) % c->seqModulus;
+        if (!inReceiveWindow(c, seq) || c->rxWindow[seq].received) continue;
+        if (missing >= 0) return -1;
+        missing = k;
+    }
+    if (missing < 0) return -1;
+
+    int seq = (first + missing) % c->seqModulus;
+    int frameSize = (field[2 + 2 * missing] << 8) | field[3 + 2 * missing];
+    if (frameSize > size - PARITY_HEADER_SIZE || frameSize > c->maxPayload) return -1;
+
+    RxSlot *slot = &c->rxWindow[seq];
+    memcpy(slot->data, field + PARITY_HEADER_SIZE, frameSize);
+    for (int k = 0; k < count; k++) {
+        if (k == missing) continue;
+        RxSlot *other = &c->rxWindow[(first + k) % c->seqModulus];
+        int n = (other->size < frameSize) ? other->size : frameSize;
+        for (int i = 0; i < n; i++) slot->data[i] ^= other->data[i];
+    }
+    slot->size = frameSize;
+    slot->received = TRUE;
+    slot->srejSent = FALSE;
+    c->numFramesRecovered++;
+    return seq;
 }
 
 ////////////////////////////////////////////////
 // LLWRITE
 ////////////////////////////////////////////////
+int llconnwritev(LinkConnection *c, const struct iovec *pieces, int count) {
+    int bufSize = 0;
+    for (int i = 0; i < count; i++) bufSize += pieces[i].iov_len;
+    if (bufSize > c->maxPayload) return -1;
+
+    // Reed-Solomon blocks and the parity group take the information field in one piece
+    if (count != 1 && (c->fecParity > 0 || c->parityGroup > 0)) {
+        int offset = 0;
+        for (int i = 0; i < count; i++) {
+            memcpy(c->gatherField + offset, pieces[i].iov_base, pieces[i].iov_len);
+            offset += pieces[i].iov_len;
+        }
+        return llconnwrite(c, c->gatherField, bufSize);
+    }
+    const unsigned char *buf = (count == 1) ? (const unsigned char *) pieces[0].iov_base : NULL;
+
+    TxSlot *slot = &c->txWindow[c->frame_number];
+    if (c->fecParity > 0) {
+        slot->frameSize = encodeFecFrame(slot->frame, ownAddress(c), ctrlI(c, c->frame_number), buf, bufSize, c->fcsType, c->fecParity, c->framing);
+    } else {
+        slot->frameSize = encodeFrameV(slot->frame, ownAddress(c), ctrlI(c, c->frame_number), pieces, count, c->fcsType, c->framing);
+    }
+    if (c->fullDuplex) refreshAcknowledgement(c, slot->frame, c->frame_number);
+
+    // Header, information field with its FCS (and FEC parity) and the two flags
+    int unstuffed = bufSize + fcsLength(c->fcsType);
+    if (c->fecParity > 0) unstuffed = FEC_FIELD_SIZE(unstuffed, c->fecParity);
+    unstuffed += 5;
+    c->numFrameBytes += unstuffed;
+    c->numStuffingBytes += slot->frameSize - unstuffed;
+    c->numPayloadBytesSent += bufSize;
+
+    int windowWasEmpty = framesOutstanding(c) == 0;
+
+    writeToPort(c, slot->frame, slot->frameSize);
+    slot->sentAt = monotonicTimeUs();
+    slot->transmissions = 1;
+    c->numFramesSent++;
+
+    printf("llwrite: Frame sent, size = %d, frame_number = %d\n", slot->frameSize, c->frame_number);
+    if (c->parityGroup > 0) {
+        addToParityGroup(c, c->frame_number, buf, bufSize);
+        if (c->groupCount == c->parityGroup) sendParityFrame(c);
+    }
+    c->frame_number = (c->frame_number + 1) % c->seqModulus;
+
+    if (windowWasEmpty) {
+        resetTimeouts(c);
+        startRetransmissionTimer(c);
+    }
+
+    // Only block while the window is full, with a window of 1 this is stop-and-wait
+    if (waitForWindow(c, c->windowSize - 1) < 0) return -1;
+    return bufSize;
+}
+
+int llconnwrite(LinkConnection *c, const unsigned char *buf, int bufSize) {
+    struct iovec piece = {(void *) buf, bufSize};
+    return llconnwritev(c, &piece, 1);
+}
+
+int llconnflush(LinkConnection *c) {
+    if (c->role != LlTx && !c->fullDuplex) return 1;
+    if (c->ackPending) sendRRFrame(c, c->rxExpected);
+    // Protect the last frames too, no later frame would reveal their loss
+    if (c->parityGroup > 0 && c->groupCount > 0) sendParityFrame(c);
+    return waitForWindow(c, 0) < 0 ? -1 : 1;
+}
+
 int llwrite(const unsigned char *buf, int bufSize) {
-    LinkLayerState state = START;
-    unsigned char byte;
-    unsigned char cField;
+    return llconnwrite(defaultConnection, buf, bufSize);
+}
 
-    int oldFrameSize;
-    unsigned char *oldFrame = buildFrame(buf, bufSize, &oldFrameSize);
+int llwritev(const struct iovec *pieces, int count) {
+    return llconnwritev(defaultConnection, pieces, count);
+}
 
-    int newFrameSize;
-    unsigned char *newFrame = byteStuffing(oldFrame, oldFrameSize, &newFrameSize);
+////////////////////////////////////////////////
+// LLREAD
+////////////////////////////////////////////////
+int deliverBufferedFrame(LinkConnection *c, unsigned char *packet) {
+    int size = c->rxWindow[c->rxDeliver].size;
+    memcpy(packet, c->rxWindow[c->rxDeliver].data, size);
+    c->rxWindow[c->rxDeliver].received = FALSE;
+    c->rxWindow[c->rxDeliver].srejSent = FALSE;
+    c->rxDeliver = (c->rxDeliver + 1) % c->seqModulus;
+    c->numFramesReceived++;
+    c->numPayloadBytesReceived += size;
+    printf("llread: Delivered buffered frame, size = %d\n", size);
+    return size;
+}
 
-    free(oldFrame);
-    STOP = FALSE;
+#define NO_PACKET -2
 
-    initializeAlarm();
-    alarm(timeout);
-    alarmEnabled = TRUE;
+// Handles a received frame other than an acknowledgement. An in-order I-frame is
+// copied to packet, or kept in the reorder buffer if packet is NULL (full duplex,
+// received while writing). Returns the packet size, 0 on DISC, -1 if the frame was
+// rejected and NO_PACKET if there is nothing for the application.
+int handleReceivedFrame(LinkConnection *c, unsigned char *packet) {
+    int seq = 0;
 
-    writeBytes((const char *)newFrame, newFrameSize);
-    numFramesSent++;
+    if (c->rxFrame.addr == ADDR_TX && c->rxFrame.ctrl == CTRL_DISC && c->role == LlRx) {
+        if (packet == NULL) return NO_PACKET; // The transmitter repeats it for llread or llclose
+        sendDISCFrame(c, ADDR_RX);
+        printf("llread: DISC frame received, closing connection.\n");
+        return 0;
+    }
+    if (c->rxFrame.addr == ADDR_TX && c->rxFrame.ctrl == CTRL_SET && c->role == LlRx) {
+        // Our UA was lost, the transmitter is still trying to connect
+        if (frameIntact(c, &c->rxFrame)) sendParameterFrame(c, CTRL_UA, "UA");
+        return NO_PACKET;
+    }
+    if (c->rxFrame.addr != peerAddress(c)) return NO_PACKET;
 
-    printf("llwrite: Frame sent, size = %d, frame_number = %d\n", newFrameSize, frame_number);
+    if (c->rxFrame.ctrl == CTRL_PARITY) {
+        if (c->parityGroup == 0 || !frameIntact(c, &c->rxFrame)) return NO_PACKET;
+        seq = recoverFromParity(c, c->rxFrame.info, c->rxFrame.infoSize);
+        if (seq < 0) return NO_PACKET;
+        printf("llread: Frame %d recovered from parity.\n", seq);
+        if (seq != c->rxExpected) return NO_PACKET; // Buffered until the frames before it arrive
 
-    while (STOP == FALSE && alarmCount < retransmissions) {
-        if (!alarmEnabled) {
-            handleAlarm();
-            if (alarmCount >= retransmissions) {
-                free(newFrame);
-                return -1;
-            }
-            writeBytes((const char *)newFrame, newFrameSize);
-            numFramesSent++;
-            printf("llwrite: Retransmitted frame, size = %d, frame_number = %d\n", newFrameSize, frame_number);
+        while (c->rxWindow[c->rxExpected].received) {
+            c->rxExpected = (c->rxExpected + 1) % c->seqModulus;
+        }
+        acknowledgeReceived(c);
+        return packet ? deliverBufferedFrame(c, packet) : NO_PACKET;
+    }
+    if (!isIFrame(c, c->rxFrame.ctrl, &seq) || c->rxFrame.infoSize == 0) return NO_PACKET;
+
+    if (!frameIntact(c, &c->rxFrame)) {
+        printf("Error: FCS check failed, retransmission needed.\n");
+        if (c->arq == LlSelectiveRepeat && inReceiveWindow(c, seq) && !c->rxWindow[seq].received) {
+            sendSREJFrame(c, seq);
+            c->rxWindow[seq].srejSent = TRUE;
+        } else if (c->arq == LlGoBackN && seq == c->rxExpected) {
+            sendREJFrame(c, c->rxExpected);
         }
+        return -1;
+    }
 
-        if (readByte((char *)&byte) > 0) {
-            printf("llwrite: Byte received = 0x%02X, current state = %d\n", byte, state);
-            if (handleLlwriteStateTransition(&state, byte, &cField)) {
-                alarm(0);
-                alarmEnabled = FALSE;
-                free(newFrame);
-                frame_number = 1 - frame_number;
-                STOP = TRUE;
-                printf("llwrite: Frame acknowledged, transmission successful.\n");
-                alarmCount = 0;
-                return bufSize;
+    if (seq == c->rxExpected && inReceiveWindow(c, seq)) {
+        if (packet == NULL) {
+            bufferFrame(c, seq, c->rxFrame.info, c->rxFrame.infoSize);
+        } else {
+            memcpy(packet, c->rxFrame.info, c->rxFrame.infoSize);
+            // A retransmission asked for by SREJ, the number may be missing again later
+            c->rxWindow[seq].srejSent = FALSE;
+            if (c->parityGroup > 0) {
+                // Kept until its group's parity frame has been used
+                memcpy(c->rxWindow[seq].data, c->rxFrame.info, c->rxFrame.infoSize);
+                c->rxWindow[seq].size = c->rxFrame.infoSize;
             }
+            c->rxExpected = (c->rxExpected + 1) % c->seqModulus;
+            c->rxDeliver = c->rxExpected;
         }
-
-        if (alarmCount >= retransmissions) {
-            STOP = TRUE;
-            printf("llwrite: Maximum retransmissions reached, transmission failed.\n");
-            break;
+        // Buffered frames right after this one are now in order as well
+        while (c->rxWindow[c->rxExpected].received) {
+            c->rxExpected = (c->rxExpected + 1) % c->seqModulus;
         }
+        acknowledgeReceived(c);
+        if (packet == NULL) return NO_PACKET;
+        c->numFramesReceived++;
+        c->numPayloadBytesReceived += c->rxFrame.infoSize;
+        return c->rxFrame.infoSize;
+    } else if (c->arq == LlSelectiveRepeat && inReceiveWindow(c, seq)) {
+        printf("llread: Frame %d buffered (expected %d).\n", seq, c->rxExpected);
+        bufferFrame(c, seq, c->rxFrame.info, c->rxFrame.infoSize);
+        requestMissingFrames(c, seq);
+    } else {
+        // Duplicate, out of order (Go-Back-N) or no room left: drop it and repeat the RR
+        printf("llread: Unexpected frame %d (expected %d), discarded.\n", seq, c->rxExpected);
+        sendRRFrame(c, c->rxExpected);
     }
-
-    free(newFrame);
-    return -1;
+    return NO_PACKET;
 }
 
-////////////////////////////////////////////////
-// LLREAD
-////////////////////////////////////////////////
-int llread(unsigned char *packet) {
-    enum ReadFrame {
-        START,          
-        FLAG_RCV,       
-        A_RCV,          
-        C_RCV,          
-        READING_DATA,   
-        DATA_ESCAPED,   
-        STOP_STATE      
-    } state = START;
-    
-    unsigned char byte;
-    unsigned char controlField;
-    int dataIdx = 0;
+int llconnread(LinkConnection *c, unsigned char *packet) {
+    // Frames completed by an earlier retransmission, or received while writing with
+    // full duplex, are delivered first, in order
+    if (c->rxDeliver != c->rxExpected) return deliverBufferedFrame(c, packet);
 
     printf("llread: Waiting to receive frame...\n");
 
-    while (state != STOP_STATE) {
-        if (readByte((char *)&byte)) {
-            printf("llread: Byte received = 0x%02X, current state = %d\n", byte, state);
-            switch (state) {
-                case START:
-                    if (byte == FLAG) 
-                        state = FLAG_RCV;
-                    break;
-
-                case FLAG_RCV:
-                    if (byte == ADDR_TX) {
-                        state = A_RCV;
-                    } else if (byte != FLAG) {
-                        state = START;
-                    }
-                    break;
-
-                case A_RCV:
-                    if (byte == CTRL_I_0 || byte == CTRL_I_1) {
-                        controlField = byte;
-                        state = C_RCV;
-                        printf("llread: Control field detected = 0x%02X\n", controlField);
-                    } else if (byte == FLAG) {
-                        state = FLAG_RCV;
-                    } else if (byte == CTRL_DISC) {
-                        sendDISCFrame();
-                        printf("llread: DISC frame received, closing connection.\n");
-                        return 0;
-                    } else {
-                        state = START;
-                    }
-                    break;
-
-                case C_RCV:
-                    if (byte == (ADDR_TX ^ controlField)) {
-                        state = READING_DATA;
-                        printf("llread: BCC1 check passed.\n");
-                    } else if (byte == FLAG) {
-                        state = FLAG_RCV;
-                    } else {
-                        state = START;
-                    }
-                    break;
-
-                case READING_DATA:
-                    if (byte == FLAG) {
-                        unsigned char bcc2 = packet[dataIdx - 1];  
-                        dataIdx--;  
-                        packet[dataIdx] = '\0';  
-
-                        unsigned char acc = packet[0];  
-                        for (int j = 1; j < dataIdx; j++)
-                            acc ^= packet[j];  
-
-                        if (bcc2 == acc) {
-                            state = STOP_STATE;
-                            sendRRFrame(frame_number == 0 ? 1 : 0);
-                            frame_number = (frame_number + 1) % 2;
-                            numFramesReceived++;
-                            return dataIdx;  
-                        } else {
-                            printf("Error: BCC2 check failed, retransmission needed.\n");
-                            sendREJFrame(frame_number == 0 ? 0 : 1);
-                            return -1;  
-                        }
-                    } else if (byte == ESC) {
-                        state = DATA_ESCAPED;  
-                    } else {
-                        packet[dataIdx++] = byte; 
-                    }
-                    break;
-
-                case DATA_ESCAPED:
-                    state = READING_DATA; 
-                    if (byte == (FLAG ^ 0x20)) {
-                        packet[dataIdx++] = FLAG;  
-                    } else if (byte == (ESC ^ 0x20)) {
-                        packet[dataIdx++] = ESC; 
-                    } else {
-                        packet[dataIdx++] = ESC;  
-                        packet[dataIdx++] = byte; 
-                    }
-                    break;
-
-                default:
-                    state = START;
-                    break;
-            }
+    while (TRUE) {
+        if (!receiveFrame(c)) {
+            // With full duplex our own frames may still need resending
+            if (c->fullDuplex && serviceTimer(c) < 0) return -1;
+            waitForEvent(c, -1);
+            continue;
         }
+        if (c->fullDuplex && handleAcknowledgement(c)) continue;
+
+        int size = handleReceivedFrame(c, packet);
+        if (size != NO_PACKET) return size;
     }
-    return -1;  
+    return -1;
 }
 
-////////////////////////////////////////////////
-// LLCLOSE
-////////////////////////////////////////////////
-int llclose(int showStatistics) {
-
-    if (role == LlTx) {
-        sendDISCFrame(); 
+int llconnpending(LinkConnection *c) {
+    if (c->fullDuplex) {
+        waitForEvent(c, 0);
+        if (serviceWindow(c) < 0) return -1;
+    }
+    return c->rxDeliver != c->rxExpected;
+}
 
-        LinkLayerState state = START;
-        unsigned char byte;
-        alarmCount = 0;
+int llpending() {
+    return llconnpending(defaultConnection);
+}
 
-        initializeAlarm();
-        alarm(timeout); 
-        alarmEnabled = TRUE;
+int llread(unsigned char *packet) {
+    return llconnread(defaultConnection, packet);
+}
 
-        while (STOP == FALSE) {
-            if (!alarmEnabled) {  
-                handleAlarm();
-                if (alarmCount >= retransmissions) {
-                    return -1;
-                }
-                sendDISCFrame();
+////////////////////////////////////////////////
+// LLCLOSE
+////////////////////////////////////////////////
+// DISC/UA exchange, after the last frames are acknowledged.
+// Returns 1 on success or -1 on error.
+int disconnect(LinkConnection *c) {
+    int seq;
+
+    if (c->role == LlTx) {
+        // Wait for the frames still in the window to be acknowledged
+        if (llconnflush(c) < 0) return -1;
+
+        sendDISCFrame(c, ADDR_TX);
+        resetTimeouts(c);
+        startRetransmissionTimer(c);
+
+        while (TRUE) {
+            if (!c->timerRunning) {
+                if (retransmissionsExhausted(c)) return -1;
+                sendDISCFrame(c, ADDR_TX);
+                c->numRetransmissions++;
+                c->numTimeoutRetransmissions++;
+                startRetransmissionTimer(c);
             }
 
-            if (readByte((char*)&byte) > 0) {
-                if (handleStateMachine(&state, byte, ADDR_RX, CTRL_DISC, ADDR_RX ^ CTRL_DISC) == 1) {
-                    alarm(0);
-                    alarmEnabled = FALSE;
-                    STOP = TRUE;
-                }
+            if (!receiveFrame(c)) {
+                waitForEvent(c, -1);
+                continue;
+            }
+            if (c->rxFrame.addr == ADDR_RX && c->rxFrame.ctrl == CTRL_DISC) break;
+            // With full duplex the RR for the receiver's last frame may have been lost
+            if (c->fullDuplex && c->rxFrame.addr == ADDR_RX && isIFrame(c, c->rxFrame.ctrl, &seq)) {
+                sendRRFrame(c, c->rxExpected);
             }
         }
 
-        sendUAFrame();
+        stopRetransmissionTimer(c);
+        sendUAFrame(c, ADDR_RX);
 
-    } else if (role == LlRx) {
-        LinkLayerState state = START;
-        unsigned char byte;
-        STOP = FALSE;
+    } else if (c->role == LlRx) {
+        if (c->fullDuplex && llconnflush(c) < 0) return -1;
 
-        while (STOP == FALSE) {
-            if (readByte((char*)&byte) > 0) {
-                if (handleStateMachine(&state, byte, ADDR_TX, CTRL_DISC, ADDR_TX ^ CTRL_DISC) == 1) {
-                    STOP = TRUE;
-                }
+        while (TRUE) {
+            if (!receiveFrame(c)) {
+                waitForEvent(c, -1);
+                continue;
             }
+            if (c->rxFrame.addr != ADDR_TX) continue;
+            if (c->rxFrame.ctrl == CTRL_DISC) break;
+            // The RR for the last frame was lost and it is being retransmitted
+            if (isIFrame(c, c->rxFrame.ctrl, &seq)) sendRRFrame(c, c->rxExpected);
         }
 
-        sendDISCFrame();
+        sendDISCFrame(c, ADDR_RX);
+        resetTimeouts(c);
+        startRetransmissionTimer(c);
 
-        state = START;
-        handleAlarm();
-
-        while (STOP == FALSE) {
-            if (!alarmEnabled) {  
-                handleAlarm();
-                if (alarmCount >= retransmissions) {
-                    return -1;
-                }
-                sendDISCFrame();
+        while (TRUE) {
+            if (!c->timerRunning) {
+                if (retransmissionsExhausted(c)) return -1;
+                sendDISCFrame(c, ADDR_RX);
+                startRetransmissionTimer(c);
             }
 
-            if (readByte((char*)&byte) > 0) {
-                if (handleStateMachine(&state, byte, ADDR_RX, CTRL_UA, ADDR_RX ^ CTRL_UA) == 1) {
-                    alarm(0); 
-                    alarmEnabled = FALSE;
-                    STOP = TRUE;
-                }
+            if (!receiveFrame(c)) {
+                waitForEvent(c, -1);
+                continue;
             }
+            if (c->rxFrame.addr == ADDR_RX && c->rxFrame.ctrl == CTRL_UA) break;
+            // Our DISC was lost, the transmitter is repeating its own
+            if (c->rxFrame.addr == ADDR_TX && c->rxFrame.ctrl == CTRL_DISC) sendDISCFrame(c, ADDR_RX);
         }
+
+        stopRetransmissionTimer(c);
     }
+    return 1;
+}
 
-    closeSerialPort();
+// Figures derived from the counters, shared by the printout and the JSON export
+typedef struct {
+    double durationS;
+    double goodputBps;       // Payload bits per second, both directions together
+    double efficiency;       // Goodput over the baud rate (8N1 framing alone caps it at 0.8)
+    double stuffingOverhead; // Escapes added per I-frame byte
+    double rttMinMs;
+    double rttAvgMs;
+    double rttP99Ms;         // Over the last RTT_HISTORY_SIZE samples
+    double idleS;
+} LinkSummary;
+
+int compareSamples(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+void summarize(LinkConnection *c, LinkSummary *s) {
+    memset(s, 0, sizeof(*s));
+    s->durationS = (monotonicTimeUs() - c->openedAtUs) / 1e6;
+    s->idleS = c->idleUs / 1e6;
+    if (s->durationS > 0)
+        s->goodputBps = (c->numPayloadBytesSent + c->numPayloadBytesReceived) * 8 / s->durationS;
+    if (c->baudRate > 0) s->efficiency = s->goodputBps / c->baudRate;
+    if (c->numFrameBytes > 0) s->stuffingOverhead = (double)c->numStuffingBytes / c->numFrameBytes;
+
+    if (c->numRttSamples > 0) {
+        int n = c->numRttSamples < RTT_HISTORY_SIZE ? c->numRttSamples : RTT_HISTORY_SIZE;
+        int *sorted = (int *) malloc(n * sizeof(int));
+        if (sorted != NULL) {
+            memcpy(sorted, c->rttHistory, n * sizeof(int));
+            qsort(sorted, n, sizeof(int), compareSamples);
+            s->rttP99Ms = sorted[(n * 99 + 99) / 100 - 1] / 1000.0;
+            free(sorted);
+        }
+        s->rttMinMs = c->rttMinUs / 1000.0;
+        s->rttAvgMs = c->rttSumUs / 1000.0 / c->numRttSamples;
+    }
+}
+
+// One JSON object per line, with the settings so that runs can be told apart
+void writeStatistics(LinkConnection *c, LinkSummary *s, int result) {
+    FILE *file = fopen(c->statsFile, "a");
+    if (file == NULL) {
+        perror(c->statsFile);
+        return;
+    }
+
+    fprintf(file, "{\"port\": \"%s\", \"role\": \"%s\", \"closed\": %s, ",
+            c->serialPort, c->role == LlTx ? "tx" : "rx", result > 0 ? "true" : "false");
+    fprintf(file, "\"baud_rate\": %d, \"window_size\": %d, \"arq\": \"%s\", \"fcs\": %d, \"max_payload\": %d, "
+            "\"fec_parity\": %d, \"parity_group\": %d, \"full_duplex\": %s, \"framing\": \"%s\", ",
+            c->baudRate, c->windowSize, c->arq == LlSelectiveRepeat ? "sr" : "gbn", c->fcsType, c->maxPayload,
+            c->fecParity, c->parityGroup, c->fullDuplex ? "true" : "false", c->framing == LlCobs ? "cobs" : "stuffing");
+    fprintf(file, "\"handshake_ms\": %.3f, \"set_frames\": %d, ", c->handshakeUs / 1000.0, c->numSetFrames);
+    fprintf(file, "\"duration_s\": %.6f, \"payload_bytes_sent\": %ld, \"payload_bytes_received\": %ld, "
+            "\"goodput_bps\": %.1f, \"efficiency\": %.4f, ",
+            s->durationS, c->numPayloadBytesSent, c->numPayloadBytesReceived, s->goodputBps, s->efficiency);
+    fprintf(file, "\"bytes_written\": %ld, \"bytes_read\": %ld, \"stuffing_overhead\": %.6f, ",
+            c->numBytesWritten, c->numBytesRead, s->stuffingOverhead);
+    fprintf(file, "\"frames_sent\": %d, \"retransmissions\": %d, \"timeout_retransmissions\": %d, "
+            "\"reject_retransmissions\": %d, \"parity_frames_sent\": %d, ",
+            c->numFramesSent, c->numRetransmissions, c->numTimeoutRetransmissions,
+            c->numRejectRetransmissions, c->numParityFramesSent);
+    fprintf(file, "\"rtt_samples\": %d, \"rtt_min_ms\": %.3f, \"rtt_avg_ms\": %.3f, \"rtt_p99_ms\": %.3f, "
+            "\"srtt_ms\": %.3f, \"rttvar_ms\": %.3f, \"final_timeout_ms\": %ld, ",
+            c->numRttSamples, s->rttMinMs, s->rttAvgMs, s->rttP99Ms,
+            c->srttUs / 1000.0, c->rttvarUs / 1000.0, c->rtoMs);
+    fprintf(file, "\"idle_s\": %.6f, \"read_calls\": %ld, \"read_calls_with_data\": %ld, \"frames_deframed\": %ld, ",
+            s->idleS, c->numReadCalls, c->numReadCallsWithData, c->numFramesDeframed);
+    fprintf(file, "\"frames_received\": %d, \"frames_acknowledged\": %d, \"frames_rejected\": %d, "
+            "\"acks_piggybacked\": %d, \"fec_corrected_bytes\": %d, \"fec_corrected_frames\": %d, "
+            "\"frames_recovered\": %d}\n",
+            c->numFramesReceived, c->numFramesAcknowledged, c->numFramesRejected,
+            c->numPiggybackedAcks, c->numFecCorrectedBytes, c->numFecCorrectedFrames, c->numFramesRecovered);
+    fclose(file);
+}
+
+int llconnclose(LinkConnection *c, int showStatistics) {
+    // The connection is released even if the peer did not answer
+    int result = disconnect(c);
 
-    if (showStatistics) {
+    LinkSummary s;
+    summarize(c, &s);
+    if (c->statsFile != NULL) writeStatistics(c, &s, result);
+
+    if (result > 0 && showStatistics) {
         printf("Statistics:\n");
-        if(role == LlRx)
-            printf("Frames Sent: %d\n", numFramesSent);
-        if(role == LlTx)
-            printf("Frames Sent: %d\n", numFramesSent - 1);
-        if(role == LlTx)
-            printf("Retransmissions: %d\n", numRetransmissions);
-        if(role == LlRx){
-            printf("Information Frames Received: %d\n", numFramesReceived);
-            printf("Information Frames Acknowledged: %d\n", numFramesAcknowledged);
-            printf("Information Frames Rejected: %d\n", numFramesRejected);
+        printf("Duration: %.2f s, goodput %.0f bit/s (%.1f%% of %d baud), idle %.2f s (%.0f%%)\n",
+               s.durationS, s.goodputBps, 100 * s.efficiency, c->baudRate,
+               s.idleS, s.durationS > 0 ? 100 * s.idleS / s.durationS : 0);
+        printf("Handshake: %.1f ms", c->handshakeUs / 1000.0);
+        if (c->role == LlTx) printf(" (%d SET frames)", c->numSetFrames);
+        printf("\n");
+        printf("Bytes Written: %ld, Bytes Read: %ld\n", c->numBytesWritten, c->numBytesRead);
+        if(c->role == LlRx)
+            printf("Frames Sent: %d\n", c->numFramesSent);
+        if(c->role == LlTx)
+            printf("Frames Sent: %d\n", c->numFramesSent - 1);
+        if(c->role == LlTx || c->fullDuplex) {
+            printf("Retransmissions: %d (%d on timeout, %d on reject)\n",
+                   c->numRetransmissions, c->numTimeoutRetransmissions, c->numRejectRetransmissions);
+            printf("Stuffing Overhead: %.2f%% (%ld bytes added to %ld frame bytes)\n",
+                   100 * s.stuffingOverhead, c->numStuffingBytes, c->numFrameBytes);
+            if (c->parityGroup > 0)
+                printf("Parity Frames Sent: %d\n", c->numParityFramesSent);
+            printf("Round-Trip Time: %.1f ms (deviation %.1f ms, %d samples), final timeout %ld ms\n",
+                   c->srttUs / 1000.0, c->rttvarUs / 1000.0, c->numRttSamples, c->rtoMs);
+            printf("Round-Trip Time Samples: min %.1f ms, avg %.1f ms, p99 %.1f ms\n",
+                   s.rttMinMs, s.rttAvgMs, s.rttP99Ms);
+        }
+        double frames = c->numFramesDeframed ? c->numFramesDeframed : 1;
+        printf("Read Syscalls per Frame: %.2f with data, %.2f without (%ld frames)\n",
+               c->numReadCallsWithData / frames, (c->numReadCalls - c->numReadCallsWithData) / frames, c->numFramesDeframed);
+        if(c->role == LlRx || c->fullDuplex){
+            printf("Information Frames Received: %d\n", c->numFramesReceived);
+            printf("Information Frames Acknowledged: %d\n", c->numFramesAcknowledged);
+            printf("Information Frames Rejected: %d\n", c->numFramesRejected);
+            if (c->fullDuplex)
+                printf("Acknowledgements Piggybacked: %d\n", c->numPiggybackedAcks);
+            if (c->fecParity > 0)
+                printf("FEC Corrected: %d bytes in %d frames\n", c->numFecCorrectedBytes, c->numFecCorrectedFrames);
+            if (c->parityGroup > 0)
+                printf("Frames Recovered from Parity: %d\n", c->numFramesRecovered);
         }
     }
 
-    return 1;
+    freeConnection(c);
+    return result;
+}
+
+int llclose(int showStatistics) {
+    int result = llconnclose(defaultConnection, showStatistics);
+    defaultConnection = NULL;
+    return result;
 }
@@ -0,0 +1,377 @@
+// LZ77 with the LZ4 block format: each sequence is a token (literal count in the high
+// nibble, match length - 4 in the low one, 15 meaning more length bytes follow), the
+// literals, and a 2-byte little-endian offset. The last sequence of a block has
+// literals only. The block can end anywhere, the decoder checks every length.
+
+#include "lz.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET (LZ_WINDOW_SIZE - 1)
+#define HASH_BITS 16
+#define DENSE_DEPTH 64 // Candidates tried per position by LzDense
+
+// Input is stored without trying to compress it when fewer than 1 in BYPASS_COLLISIONS
+// pairs of its bytes are equal, a collision entropy above 7.5 bits per byte
+#define BYPASS_COLLISIONS 181
+
+// History, pending input and room to read more before sliding the window back
+#define BUFFER_SIZE (4 * LZ_WINDOW_SIZE)
+
+struct LzEncoder {
+    LzCodec codec;
+    unsigned char buffer[BUFFER_SIZE];
+    int size;    // Stream bytes compressed so far that are still in buffer
+    int pending; // Input after them
+    long base;   // Stream position of buffer[0]
+    int head[1 << HASH_BITS];             // Latest position with each hash, -1 if none
+    unsigned short chain[LZ_WINDOW_SIZE]; // LzDense: distance to the previous one, 0 if none
+};
+
+struct LzDecoder {
+    unsigned char buffer[BUFFER_SIZE];
+    int size;
+};
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+static int hash(const unsigned char *p) {
+    return (read32(p) * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// Length of the common prefix of a and b, a reading no further than end
+static int matchLength(const unsigned char *a, const unsigned char *b, const unsigned char *end) {
+    const unsigned char *start = a;
+    while (a + 8 <= end) {
+        uint64_t x, y;
+        memcpy(&x, a, 8);
+        memcpy(&y, b, 8);
+        if (x != y) return a - start + __builtin_ctzll(x ^ y) / 8;
+        a += 8;
+        b += 8;
+    }
+    while (a < end && *a == *b) {
+        a++;
+        b++;
+    }
+    return a - start;
+}
+
+LzEncoder *lzEncoderCreate(LzCodec codec) {
+    LzEncoder *e = (LzEncoder *) calloc(1, sizeof(LzEncoder));
+    if (e == NULL) return NULL;
+    e->codec = codec;
+    memset(e->head, -1, sizeof(e->head));
+    return e;
+}
+
+void lzEncoderFree(LzEncoder *e) {
+    free(e);
+}
+
+// Keeps the last LZ_WINDOW_SIZE compressed bytes and the pending input
+static void slideEncoder(LzEncoder *e) {
+    int shift = e->size - LZ_WINDOW_SIZE;
+    memmove(e->buffer, e->buffer + shift, LZ_WINDOW_SIZE + e->pending);
+    e->size -= shift;
+    e->base += shift;
+    for (int i = 0; i < (1 << HASH_BITS); i++) {
+        e->head[i] = (e->head[i] >= shift) ? e->head[i] - shift : -1;
+    }
+}
+
+static void insertPosition(LzEncoder *e, int pos);
+
+void lzPrime(LzEncoder *e, const unsigned char *history, int size) {
+    if (size > LZ_WINDOW_SIZE) {
+        history += size - LZ_WINDOW_SIZE;
+        size = LZ_WINDOW_SIZE;
+    }
+    memcpy(e->buffer, history, size);
+    for (int pos = 0; pos + MIN_MATCH <= size; pos++) {
+        if (e->codec == LzDense) insertPosition(e, pos);
+        else e->head[hash(e->buffer + pos)] = pos;
+    }
+    e->size = size;
+}
+
+unsigned char *lzInput(LzEncoder *e, int *room) {
+    if (e->size + e->pending + LZ_MAX_BLOCK > BUFFER_SIZE) slideEncoder(e);
+    *room = LZ_MAX_BLOCK - e->pending;
+    return e->buffer + e->size + e->pending;
+}
+
+void lzAppend(LzEncoder *e, int size) {
+    e->pending += size;
+}
+
+int lzPending(LzEncoder *e) {
+    return e->pending;
+}
+
+static int lengthBytes(int length) {
+    return (length >= 15) ? (length - 15) / 255 + 1 : 0;
+}
+
+static unsigned char *writeLength(unsigned char *out, int length) {
+    if (length < 15) return out;
+    for (length -= 15; length >= 255; length -= 255) *out++ = 255;
+    *out++ = length;
+    return out;
+}
+
+// Writes a sequence if it fits before limit, returns the new end or NULL
+static unsigned char *writeSequence(unsigned char *out, unsigned char *limit, const unsigned char *literals,
+                                    int numLiterals, int offset, int length) {
+    int cost = 1 + lengthBytes(numLiterals) + numLiterals + 2 + lengthBytes(length - MIN_MATCH);
+    if (cost > limit - out) return NULL;
+
+    int literalCode = (numLiterals < 15) ? numLiterals : 15;
+    int lengthCode = (length - MIN_MATCH < 15) ? length - MIN_MATCH : 15;
+    *out++ = (literalCode << 4) | lengthCode;
+    out = writeLength(out, numLiterals);
+    memcpy(out, literals, numLiterals);
+    out += numLiterals;
+    *out++ = offset & 0xFF;
+    *out++ = offset >> 8;
+    return writeLength(out, length - MIN_MATCH);
+}
+
+// Ends the block with as many of the literals as fit, returns how many did
+static int writeLastLiterals(unsigned char **out, unsigned char *limit, const unsigned char *literals, int numLiterals) {
+    int room = limit - *out;
+    if (numLiterals == 0 || room < 2) return 0;
+    if (numLiterals > room - 1) numLiterals = room - 1;
+    while (1 + lengthBytes(numLiterals) + numLiterals > room) numLiterals--;
+
+    unsigned char *o = *out;
+    *o++ = ((numLiterals < 15) ? numLiterals : 15) << 4;
+    o = writeLength(o, numLiterals);
+    memcpy(o, literals, numLiterals);
+    *out = o + numLiterals;
+    return numLiterals;
+}
+
+static int validCandidate(int candidate, int pos) {
+    return candidate >= 0 && candidate < pos && pos - candidate <= MAX_OFFSET;
+}
+
+// Single probe per position, skipping faster through data without matches (LZ4)
+static int compressFast(LzEncoder *e, int start, int end, unsigned char **out, unsigned char *limit) {
+    unsigned char *b = e->buffer;
+    int anchor = start;
+    int pos = start;
+    int misses = 0;
+
+    // Stops once the literals alone would fill the block
+    while (pos + MIN_MATCH <= end && pos - anchor < limit - *out) {
+        int h = hash(b + pos);
+        int candidate = e->head[h];
+        e->head[h] = pos;
+        if (!validCandidate(candidate, pos) || read32(b + candidate) != read32(b + pos)) {
+            pos += 1 + (misses++ >> 5);
+            continue;
+        }
+        misses = 0;
+
+        int length = MIN_MATCH + matchLength(b + pos + MIN_MATCH, b + candidate + MIN_MATCH, b + end);
+        while (pos > anchor && candidate > 0 && b[pos - 1] == b[candidate - 1]) {
+            pos--;
+            candidate--;
+            length++;
+        }
+
+        unsigned char *next = writeSequence(*out, limit, b + anchor, pos - anchor, pos - candidate, length);
+        if (next == NULL) break;
+        *out = next;
+        pos += length;
+        anchor = pos;
+        if (pos + MIN_MATCH <= end) e->head[hash(b + pos - 2)] = pos - 2;
+    }
+    return anchor;
+}
+
+static void insertPosition(LzEncoder *e, int pos) {
+    int h = hash(e->buffer + pos);
+    int previous = e->head[h];
+    e->chain[(e->base + pos) & (LZ_WINDOW_SIZE - 1)] = validCandidate(previous, pos) ? pos - previous : 0;
+    e->head[h] = pos;
+}
+
+// Longest match for pos among the DENSE_DEPTH latest positions with the same hash
+static int longestMatch(LzEncoder *e, int pos, int end, int *matchPos) {
+    unsigned char *b = e->buffer;
+    int best = 0;
+    int candidate = e->head[hash(b + pos)];
+    for (int depth = 0; depth < DENSE_DEPTH && validCandidate(candidate, pos); depth++) {
+        if (b[candidate + best] == b[pos + best] || best == 0) {
+            int length = matchLength(b + pos, b + candidate, b + end);
+            if (length > best) {
+                best = length;
+                *matchPos = candidate;
+                if (pos + best == end) break;
+            }
+        }
+        int distance = e->chain[(e->base + candidate) & (LZ_WINDOW_SIZE - 1)];
+        if (distance == 0) break;
+        candidate -= distance;
+    }
+    return (best >= MIN_MATCH) ? best : 0;
+}
+
+// Every position goes in the hash chains, and a match is put off by one byte when
+// the next position has a longer one (lazy matching)
+static int compressDense(LzEncoder *e, int start, int end, unsigned char **out, unsigned char *limit) {
+    unsigned char *b = e->buffer;
+    int anchor = start;
+    int pos = start;
+
+    while (pos + MIN_MATCH <= end && pos - anchor < limit - *out) {
+        int matchPos = 0;
+        int length = longestMatch(e, pos, end, &matchPos);
+        insertPosition(e, pos);
+        if (length == 0) {
+            pos++;
+            continue;
+        }
+
+        while (pos + 1 + MIN_MATCH <= end) {
+            int nextPos = 0;
+            int nextLength = longestMatch(e, pos + 1, end, &nextPos);
+            if (nextLength <= length) break;
+            pos++;
+            insertPosition(e, pos);
+            length = nextLength;
+            matchPos = nextPos;
+        }
+
+        unsigned char *next = writeSequence(*out, limit, b + anchor, pos - anchor, pos - matchPos, length);
+        if (next == NULL) break;
+        *out = next;
+        for (int p = pos + 1; p < pos + length && p + MIN_MATCH <= end; p++) insertPosition(e, p);
+        pos += length;
+        anchor = pos;
+    }
+    return anchor;
+}
+
+// Byte histogram of the input: compressed data, images and archives look uniform
+static int looksRandom(const unsigned char *input, int size) {
+    if (size < 2) return 0;
+    int counts[256] = {0};
+    for (int i = 0; i < size; i++) counts[input[i]]++;
+
+    long collisions = 0; // Equal pairs, sum of c * (c - 1) / 2
+    for (int i = 0; i < 256; i++) collisions += (long)counts[i] * (counts[i] - 1) / 2;
+    return collisions * BYPASS_COLLISIONS < (long)size * (size - 1) / 2;
+}
+
+// Copies the input as is, it joins the history all the same
+static int store(LzEncoder *e, int start, int end, unsigned char *out) {
+    memcpy(out, e->buffer + start, end - start);
+    e->size = end;
+    e->pending -= end - start;
+    return end - start;
+}
+
+int lzCompress(LzEncoder *e, unsigned char *out, int capacity, int *compressed) {
+    int start = e->size;
+    int end = e->size + e->pending;
+    unsigned char *o = out;
+    unsigned char *limit = out + capacity;
+
+    *compressed = 0;
+    int sample = (e->pending < capacity) ? e->pending : capacity;
+    if (looksRandom(e->buffer + start, sample)) return store(e, start, start + sample, out);
+
+    int anchor = (e->codec == LzDense) ? compressDense(e, start, end, &o, limit)
+                                       : compressFast(e, start, end, &o, limit);
+    anchor += writeLastLiterals(&o, limit, e->buffer + anchor, end - anchor);
+
+    // Sequences cost more than they saved, the same input stored fits as well
+    if (o - out >= anchor - start) return store(e, start, anchor, out);
+
+    *compressed = 1;
+    e->size = anchor;
+    e->pending = end - anchor;
+    return o - out;
+}
+
+LzDecoder *lzDecoderCreate() {
+    return (LzDecoder *) calloc(1, sizeof(LzDecoder));
+}
+
+void lzDecoderFree(LzDecoder *d) {
+    free(d);
+}
+
+// Reads the extra bytes of a length, -1 if the block ends first
+static int readLength(const unsigned char **in, const unsigned char *end, int length) {
+    if (length < 15) return length;
+    unsigned char byte;
+    do {
+        if (*in >= end || length > LZ_MAX_BLOCK) return -1;
+        byte = *(*in)++;
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+int lzDecompress(LzDecoder *d, const unsigned char *block, int size, int compressed, const unsigned char **out) {
+    if (d->size + LZ_MAX_BLOCK > BUFFER_SIZE) {
+        memmove(d->buffer, d->buffer + d->size - LZ_WINDOW_SIZE, LZ_WINDOW_SIZE);
+        d->size = LZ_WINDOW_SIZE;
+    }
+
+    const unsigned char *in = block;
+    const unsigned char *end = block + size;
+    unsigned char *start = d->buffer + d->size;
+    unsigned char *o = start;
+    unsigned char *limit = start + LZ_MAX_BLOCK;
+
+    if (!compressed) {
+        if (size > LZ_MAX_BLOCK) return -1;
+        memcpy(start, block, size);
+        d->size += size;
+        *out = start;
+        return size;
+    }
+
+    while (in < end) {
+        int token = *in++;
+        int numLiterals = readLength(&in, end, token >> 4);
+        if (numLiterals < 0 || numLiterals > end - in || numLiterals > limit - o) return -1;
+        memcpy(o, in, numLiterals);
+        o += numLiterals;
+        in += numLiterals;
+        if (in == end) break;
+
+        if (end - in < 2) return -1;
+        int offset = in[0] | (in[1] << 8);
+        in += 2;
+        int length = readLength(&in, end, token & 15);
+        if (length < 0) return -1;
+        length += MIN_MATCH;
+        if (offset == 0 || offset > o - d->buffer || length > limit - o) return -1;
+
+        const unsigned char *match = o - offset;
+        if (offset >= length) {
+            memcpy(o, match, length);
+            o += length;
+        } else {
+            // Overlapping copy repeats the last offset bytes
+            for (int i = 0; i < length; i++) *o++ = match[i];
+        }
+    }
+
+    d->size += o - start;
+    *out = start;
+    return o - start;
+}
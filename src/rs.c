@@ -0,0 +1,157 @@
+// Table driven Reed-Solomon encoder and decoder (syndromes, Berlekamp-Massey, Chien
+// search and Forney). Generator roots are alpha^0 .. alpha^(nsym-1) and codeword
+// byte 0 is the highest degree coefficient.
+
+#include "rs.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#define GF_POLY 0x11D
+
+static unsigned char gfExp[2 * 256]; // Doubled so that exp[log a + log b] needs no modulo
+static unsigned char gfLog[256];
+static unsigned char rootMul[RS_MAX_PARITY][256]; // rootMul[j][x] = x * a^j, for the syndromes
+static pthread_once_t initialized = PTHREAD_ONCE_INIT;
+
+// Generator polynomial for each nsym, highest degree first (gen[nsym][0] = 1). Built
+// once by rsInit so that encoders on several links share them read-only.
+static unsigned char gen[RS_MAX_PARITY + 1][RS_MAX_PARITY + 1];
+
+static unsigned char gfMul(unsigned char a, unsigned char b) {
+    if (a == 0 || b == 0) return 0;
+    return gfExp[gfLog[a] + gfLog[b]];
+}
+
+static unsigned char gfDiv(unsigned char a, unsigned char b) {
+    if (a == 0) return 0;
+    return gfExp[gfLog[a] + 255 - gfLog[b]];
+}
+
+// alpha^power for any power, negative ones included
+static unsigned char gfPow(int power) {
+    power %= 255;
+    if (power < 0) power += 255;
+    return gfExp[power];
+}
+
+static void buildTables() {
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gfExp[i] = x;
+        gfLog[x] = i;
+        x <<= 1;
+        if (x & 0x100) x ^= GF_POLY;
+    }
+    for (int i = 255; i < 2 * 256; i++) gfExp[i] = gfExp[i - 255];
+    for (int j = 0; j < RS_MAX_PARITY; j++) {
+        for (int v = 0; v < 256; v++) rootMul[j][v] = gfMul(v, gfExp[j]);
+    }
+
+    // g(x) = (x - a^0)(x - a^1)...(x - a^(nsym-1)), each one from the previous
+    gen[0][0] = 1;
+    for (int nsym = 1; nsym <= RS_MAX_PARITY; nsym++) {
+        memcpy(gen[nsym], gen[nsym - 1], nsym);
+        unsigned char root = gfExp[nsym - 1];
+        for (int j = nsym; j > 0; j--) gen[nsym][j] ^= gfMul(gen[nsym][j - 1], root);
+    }
+}
+
+void rsInit() {
+    pthread_once(&initialized, buildTables);
+}
+
+void rsEncode(const unsigned char *data, int size, unsigned char *parity, int nsym) {
+    const unsigned char *g = gen[nsym];
+
+    // Remainder of data(x) * x^nsym divided by g(x), as a shift register
+    memset(parity, 0, nsym);
+    for (int i = 0; i < size; i++) {
+        unsigned char feedback = data[i] ^ parity[0];
+        memmove(parity, parity + 1, nsym - 1);
+        parity[nsym - 1] = 0;
+        if (feedback == 0) continue;
+        int logFeedback = gfLog[feedback];
+        for (int j = 0; j < nsym; j++) {
+            if (g[j + 1]) parity[j] ^= gfExp[logFeedback + gfLog[g[j + 1]]];
+        }
+    }
+}
+
+int rsDecode(unsigned char *codeword, int size, int nsym) {
+    unsigned char syndromes[RS_MAX_PARITY];
+    int clean = 1;
+
+    // S_j = r(a^j), evaluated with Horner's rule
+    for (int j = 0; j < nsym; j++) {
+        const unsigned char *mul = rootMul[j];
+        unsigned char s = 0;
+        for (int i = 0; i < size; i++) s = mul[s] ^ codeword[i];
+        syndromes[j] = s;
+        if (s) clean = 0;
+    }
+    if (clean) return 0;
+
+    // Berlekamp-Massey: error locator lambda(x), lowest degree first
+    unsigned char lambda[RS_MAX_PARITY + 1] = {1};
+    unsigned char prev[RS_MAX_PARITY + 1] = {1};
+    unsigned char temp[RS_MAX_PARITY + 1];
+    int errors = 0, shift = 1;
+    unsigned char prevDiscrepancy = 1;
+
+    for (int r = 0; r < nsym; r++) {
+        unsigned char d = syndromes[r];
+        for (int i = 1; i <= errors; i++) d ^= gfMul(lambda[i], syndromes[r - i]);
+
+        if (d == 0) {
+            shift++;
+            continue;
+        }
+
+        unsigned char scale = gfDiv(d, prevDiscrepancy);
+        memcpy(temp, lambda, sizeof(lambda));
+        for (int i = 0; i + shift <= nsym; i++) lambda[i + shift] ^= gfMul(scale, prev[i]);
+
+        if (2 * errors <= r) {
+            errors = r + 1 - errors;
+            memcpy(prev, temp, sizeof(prev));
+            prevDiscrepancy = d;
+            shift = 1;
+        } else {
+            shift++;
+        }
+    }
+    if (2 * errors > nsym) return -1;
+
+    // Chien search: byte i has power p = size - 1 - i, it is wrong if lambda(a^-p) = 0
+    int positions[RS_MAX_PARITY];
+    int found = 0;
+    for (int p = 0; p < size; p++) {
+        unsigned char value = 0;
+        for (int i = errors; i >= 0; i--) value = gfMul(value, gfPow(-p)) ^ lambda[i];
+        if (value == 0) {
+            if (found == errors) return -1;
+            positions[found++] = p;
+        }
+    }
+    if (found != errors) return -1;
+
+    // Error evaluator omega(x) = S(x) lambda(x) mod x^nsym
+    unsigned char omega[RS_MAX_PARITY] = {0};
+    for (int i = 0; i < nsym; i++) {
+        for (int j = 0; j <= errors && j <= i; j++) omega[i] ^= gfMul(syndromes[i - j], lambda[j]);
+    }
+
+    // Forney: e = X * omega(X^-1) / lambda'(X^-1), with X = a^p
+    for (int k = 0; k < found; k++) {
+        unsigned char xInv = gfPow(-positions[k]);
+        unsigned char num = 0, den = 0;
+        for (int i = nsym - 1; i >= 0; i--) num = gfMul(num, xInv) ^ omega[i];
+        // The formal derivative keeps the odd terms: lambda_1 + lambda_3 x^2 + ...
+        unsigned char xInv2 = gfMul(xInv, xInv);
+        for (int i = errors - (errors % 2 == 0); i >= 1; i -= 2) den = gfMul(den, xInv2) ^ lambda[i];
+        if (den == 0) return -1;
+        codeword[size - 1 - positions[k]] ^= gfMul(gfPow(positions[k]), gfDiv(num, den));
+    }
+    return found;
+}
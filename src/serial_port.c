@@ -5,6 +5,7 @@
 
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -14,30 +15,20 @@
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
 
-int fd = -1; // File descriptor for open serial port
-struct termios oldtio; // Serial port settings to restore on closing
-
-// Open and configure the serial port.
-// Returns -1 on error.
-int openSerialPort(const char *serialPort, int baudRate)
+// Handle for one open serial port
+struct SerialPort
 {
-    // Open with O_NONBLOCK to avoid hanging when CLOCAL
-    // is not yet set on the serial port (changed later)
-    int oflags = O_RDWR | O_NOCTTY | O_NONBLOCK;
-    fd = open(serialPort, oflags);
-    if (fd < 0)
-    {
-        perror(serialPort);
-        return -1;
-    }
+    int fd;                // File descriptor for open serial port
+    struct termios oldtio; // Serial port settings to restore on closing
+};
 
-    // Save current port settings
-    if (tcgetattr(fd, &oldtio) == -1)
-    {
-        perror("tcgetattr");
-        return -1;
-    }
+// Port used by the single-port functions (openSerialPort, readByte, ...)
+static SerialPort *defaultPort = NULL;
 
+// Open and configure the serial port.
+// Returns NULL on error.
+SerialPort *serialOpen(const char *serialPort, int baudRate)
+{
     // Convert baud rate to appropriate flag
     tcflag_t br;
     switch (baudRate)
@@ -53,7 +44,34 @@ int openSerialPort(const char *serialPort, int baudRate)
         case 115200: br = B115200; break;
         default:
             fprintf(stderr, "Unsupported baud rate (must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200)\n");
-            return -1;
+            return NULL;
+    }
+
+    SerialPort *port = (SerialPort *) malloc(sizeof(SerialPort));
+    if (port == NULL)
+    {
+        perror("malloc");
+        return NULL;
+    }
+
+    // Open with O_NONBLOCK to avoid hanging when CLOCAL
+    // is not yet set on the serial port (changed later)
+    int oflags = O_RDWR | O_NOCTTY | O_NONBLOCK;
+    port->fd = open(serialPort, oflags);
+    if (port->fd < 0)
+    {
+        perror(serialPort);
+        free(port);
+        return NULL;
+    }
+
+    // Save current port settings
+    if (tcgetattr(port->fd, &port->oldtio) == -1)
+    {
+        perror("tcgetattr");
+        close(port->fd);
+        free(port);
+        return NULL;
     }
 
     // New port settings
@@ -69,42 +87,86 @@ int openSerialPort(const char *serialPort, int baudRate)
     newtio.c_cc[VTIME] = 0; // Block reading
     newtio.c_cc[VMIN] = 0;  // Byte by byte
 
-    tcflush(fd, TCIOFLUSH);
+    tcflush(port->fd, TCIOFLUSH);
 
     // Set new port settings
-    if (tcsetattr(fd, TCSANOW, &newtio) == -1)
+    if (tcsetattr(port->fd, TCSANOW, &newtio) == -1)
     {
         perror("tcsetattr");
-        close(fd);
-        return -1;
+        close(port->fd);
+        free(port);
+        return NULL;
     }
 
     // Clear O_NONBLOCK flag to ensure blocking reads
     oflags ^= O_NONBLOCK;
-    if (fcntl(fd, F_SETFL, oflags) == -1)
+    if (fcntl(port->fd, F_SETFL, oflags) == -1)
     {
         perror("fcntl");
-        close(fd);
-        return -1;
+        close(port->fd);
+        free(port);
+        return NULL;
     }
 
     // Done
-    return fd;
+    return port;
 }
 
 
-// Restore original port settings and close the serial port.
+// Restore original port settings, close the serial port and free the handle.
 // Returns -1 on error.
-int closeSerialPort(void)
+int serialClose(SerialPort *port)
 {
+    if (port == NULL) return -1;
+
     // Restore the old port settings
-    if (tcsetattr(fd, TCSANOW, &oldtio) == -1)
+    int result = 0;
+    if (tcsetattr(port->fd, TCSANOW, &port->oldtio) == -1)
     {
         perror("tcsetattr");
-        return -1;
+        result = -1;
     }
 
-    return close(fd);
+    if (close(port->fd) == -1) result = -1;
+    free(port);
+    return result;
+}
+
+
+int serialRead(SerialPort *port, char *bytes, int numBytes)
+{
+    return read(port->fd, bytes, numBytes);
+}
+
+
+int serialWrite(SerialPort *port, const char *bytes, int numBytes)
+{
+    return write(port->fd, bytes, numBytes);
+}
+
+
+int serialFd(SerialPort *port)
+{
+    return port->fd;
+}
+
+
+// Open and configure the serial port.
+// Returns -1 on error.
+int openSerialPort(const char *serialPort, int baudRate)
+{
+    defaultPort = serialOpen(serialPort, baudRate);
+    return defaultPort ? defaultPort->fd : -1;
+}
+
+
+// Restore original port settings and close the serial port.
+// Returns -1 on error.
+int closeSerialPort(void)
+{
+    int result = serialClose(defaultPort);
+    defaultPort = NULL;
+    return result;
 }
 
 
@@ -113,7 +175,21 @@ int closeSerialPort(void)
 // Returns -1 on error, 0 if no byte was received, 1 if a byte was received.
 int readByte(char *byte)
 {
-    return read(fd, byte, 1);
+    return serialRead(defaultPort, byte, 1);
+}
+
+
+// Read up to numBytes that were already received on the serial port, without
+// waiting for more.
+// Returns -1 on error, otherwise the number of bytes read (0 if none were available).
+int readBytes(char *bytes, int numBytes)
+{
+    return serialRead(defaultPort, bytes, numBytes);
+}
+
+int serialPortFd()
+{
+    return serialFd(defaultPort);
 }
 
 
@@ -122,5 +198,5 @@ int readByte(char *byte)
 // Returns -1 on error, otherwise the number of bytes written.
 int writeBytes(const char *bytes, int numBytes)
 {
-    return write(fd, bytes, numBytes);
+    return serialWrite(defaultPort, bytes, numBytes);
 }
@@ -0,0 +1,56 @@
+// Retransmission timers on top of timerfd (CLOCK_MONOTONIC)
+
+#include "timer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+int createTimer()
+{
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer < 0)
+    {
+        perror("timerfd_create");
+    }
+    return timer;
+}
+
+void startTimer(int timer, long ms)
+{
+    if (ms < 1) ms = 1; // A zero it_value would disarm the timer instead
+    struct itimerspec expiry = {0};
+    expiry.it_value.tv_sec = ms / 1000;
+    expiry.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    timerfd_settime(timer, 0, &expiry, NULL);
+}
+
+void stopTimer(int timer)
+{
+    struct itimerspec disarm = {0};
+    timerfd_settime(timer, 0, &disarm, NULL);
+}
+
+int timerExpired(int timer)
+{
+    uint64_t expirations = 0;
+    if (read(timer, &expirations, sizeof(expirations)) != sizeof(expirations))
+    {
+        return 0;
+    }
+    return expirations > 0;
+}
+
+void destroyTimer(int timer)
+{
+    if (timer >= 0) close(timer);
+}
+
+long long monotonicTimeUs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}